@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <execinfo.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,8 +15,6 @@
 #include <time.h>
 #include <unistd.h>
 
-static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
-
 #ifdef DEBUG_VERSION
 size_t cur_id = 0;
 #endif
@@ -27,16 +26,120 @@ size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
 
+// the nursery is bumped by alloc_uninitialized from gc.h
+memory_chunk nursery;
 #ifdef DEBUG_VERSION
 memory_chunk heap;
+memory_chunk leaf_space;
 #else
 static memory_chunk heap;
+static memory_chunk leaf_space;
 #endif
+// objects of up to this size in words are allocated by alloc_uninitialized without calls, see
+// update_inline_allocation
+size_t gc_inline_max_size;
+
+// the old space and the leaf space are prefixes of ranges reserved once by __init, they grow by
+// committing more of the ranges and never move
+
+// heap sizing policy: limits in words and the target fraction of time spent in GC (0 if not set),
+// see next_heap_size
+static size_t             heap_initial_size = INITIAL_HEAP_SIZE;
+static size_t             heap_max_size     = HEAP_RESERVE_SIZE;
+static double             gc_time_target;
+static double             gc_cost_per_word;   // in nanoseconds per live word of a full collection
+static double             alloc_rate;         // in words per nanosecond of the mutator
+static size_t             allocated_words;    // since the last full collection, see count_young_words
+static unsigned long long mutator_start;      // end of the last full collection
+static unsigned long long pause_at_mutator_start;
+
+static remembered_set remembered;
+
+static large_object_space large_objects;
+static size_t             large_allocated;   // in words since the last full collection
+
+static int         gc_threads = GC_THREADS;
+static mark_worker mark_workers[MAX_GC_THREADS];
+static int         mark_workers_number;
+static int         mark_idle_workers;
+
+// object_starts[i] is the offset (in words) from heap.begin of the object covering the beginning of
+// the i-th region of the old space, it lets threads start walking the heap from any region
+static size_t            *object_starts;
+static size_t             object_starts_capacity;
+static compaction_region *regions;
+static size_t             regions_number;
+static size_t             regions_capacity;
+static size_t             next_region;
+
+// mark bits of the old space, of the leaf space and of the nursery, indices are offsets in words
+// from the beginning of the chunk; bits are cleared at the end of compact_phase
+static mark_bitmap heap_marks;
+static mark_bitmap leaf_marks;
+static mark_bitmap nursery_marks;
+// new contents of young objects moved by a full collection, indexed by offsets of their headers
+// from nursery.begin. Unlike a minor collection, a full one still walks the nursery after young
+// objects get new places, so their headers cannot be overwritten by forward addresses
+static size_t *young_forwards;
+// live words of the leaf space after the current compaction, set by compute_locations
+static size_t leaf_live_size;
+
+static compaction_mode compaction = SLIDING_COMPACTION;
+// live objects of the old space and of the nursery in depth-first order, they are copied here by
+// dfs_compute_locations and back into the old space by dfs_physically_relocate
+static size_t *dfs_copy;
+static size_t  dfs_copy_size;   // in words, an upper bound of the live size
+static size_t  dfs_live_size;
+// mark-region mode: free runs of the old space found by the last collection, allocation bumps
+// [hole_cursor, hole_limit) and then takes the next hole; block_live[i] is the number of live words
+// of the i-th block of the old space at the last collection
+static hole_list  holes;
+static size_t    *hole_cursor;
+static size_t    *hole_limit;
+static size_t    *block_live;
+static size_t     blocks_number;
+static size_t     blocks_capacity;
+// objects promoted into holes by a minor collection, they are not in the queue of Cheney's
+// algorithm
+static mark_stack promoted;
+
+static gc_statistics gc_stats;
+
+// grey objects of the incremental marking are kept in the private stack of mark_workers[0], so the
+// final mark continues from them
+static unsigned long long gc_pause_target;   // in nanoseconds
+static bool               incremental_marking;
+static size_t             slice_budget = INCREMENTAL_MIN_SLICE;
+static size_t             slice_period;   // words allocated between two slices
+static size_t             allocated_since_slice;
+static double             mark_rate = 0.1;   // words per nanosecond, measured by slices
 
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
 
+static void *gc_alloc_on_nursery (size_t size);
+static void *gc_alloc_on_leaf_space (size_t size);
+static void *gc_alloc_leaf (size_t size);
+static void  full_collection (size_t additional_size);
+static void  incremental_step (size_t size);
+static void  commit_chunk (memory_chunk *chunk, size_t size);
+static void  mark_stack_push (mark_stack *st, void *obj);
+static size_t *alloc_in_holes (size_t size);
+static void    seal_hole (void);
+
+static unsigned long long gc_clock (void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void record_pause (unsigned long long start) {
+  unsigned long long pause = gc_clock() - start;
+  gc_stats.total_pause += pause;
+  gc_stats.max_pause = MAX(gc_stats.max_pause, pause);
+}
+
 void handler (int sig) {
   void *array[10];
   int   size;
@@ -48,30 +151,86 @@ void handler (int sig) {
   exit(1);
 }
 
-void *alloc (size_t size) {
+// clear is false for objects whose fields are all written by the caller, memory of large objects
+// comes zeroed from mmap anyway
+static void *allocate (size_t size, bool leaf, bool clear) {
 #ifdef DEBUG_VERSION
   ++cur_id;
 #endif
-  size_t bytes_sz = size;
-  size            = BYTES_TO_WORDS(size);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "allocation of size %zu words (%zu bytes): ", size, bytes_sz);
+  fprintf(stderr, "allocation of size %zu words (%zu bytes): ", BYTES_TO_WORDS(size), size);
 #endif
-  void *p = gc_alloc_on_existing_heap(size);
-  if (!p) {
-    // not enough place in the heap, need to perform GC cycle
-    p = gc_alloc(size);
+  size = BYTES_TO_WORDS(size);
+  // the mark-region mode has no incremental marking and no leaf space
+  bool mark_region = compaction == MARK_REGION_COMPACTION;
+  if (gc_pause_target != 0 && !mark_region) { incremental_step(size); }
+  void *p;
+  if (size < LARGE_OBJECT_SIZE && nursery.size != 0
+      && size * NURSERY_MAX_OBJECT_PART <= nursery.size) {
+    // young objects are counted when the nursery is emptied
+    p = gc_alloc_on_nursery(size);
+    if (!p) {
+      unsigned long long start = gc_clock();
+      minor_phase();
+      record_pause(start);
+      p = gc_alloc_on_nursery(size);
+    }
+  } else if (size >= LARGE_OBJECT_SIZE) {
+    allocated_words += size;
+    return alloc_large(size);
+  } else if (leaf && !mark_region) {
+    allocated_words += size;
+    p = gc_alloc_on_leaf_space(size);
+    if (!p) {
+      unsigned long long start = gc_clock();
+      p                        = gc_alloc_leaf(size);
+      record_pause(start);
+    }
+  } else {
+    allocated_words += size;
+    p = gc_alloc_on_existing_heap(size);
+    if (!p) {
+      // not enough place in the heap, need to perform GC cycle
+      unsigned long long start = gc_clock();
+      p                        = gc_alloc(size);
+      record_pause(start);
+    }
   }
+  if (clear) { memset(p, 0, WORDS_TO_BYTES(size)); }
   return p;
 }
 
+void *alloc (size_t size) { return allocate(size, false, true); }
+
+void *alloc_leaf (size_t size) { return allocate(size, true, true); }
+
+void *alloc_uninitialized_slow (size_t size) { return allocate(size, false, false); }
+
+// the fast path of alloc_uninitialized is taken only where allocate would take the nursery without
+// any other work: there is no incremental_step to call and no object id to assign
+static void update_inline_allocation (void) {
+#ifdef DEBUG_VERSION
+  gc_inline_max_size = 0;
+#else
+  bool paced = gc_pause_target != 0 && compaction != MARK_REGION_COMPACTION;
+  gc_inline_max_size =
+      paced ? 0 : MIN(nursery.size / NURSERY_MAX_OBJECT_PART, LARGE_OBJECT_SIZE - 1);
+#endif
+}
+
+// the nursery is emptied by every collection, its objects were allocated since the last one
+static inline void count_young_words (void) { allocated_words += nursery.current - nursery.begin; }
+
 #ifdef FULL_INVARIANT_CHECKS
 
+// internal mark-bit of objects_dfs, it is kept in the highest bit of the object id
+#  define DFS_VISITED_BIT ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
 // precondition: obj_content is a valid address pointing to the content of an object
 static void print_object_info (FILE *f, void *obj_content) {
   data  *d       = TO_DATA(obj_content);
   size_t obj_tag = TAG(d->data_header);
-  size_t obj_id  = d->id;
+  size_t obj_id  = d->id & ~DFS_VISITED_BIT;
   fprintf(f, "id %zu tag %zu | ", obj_id, obj_tag);
 }
 
@@ -102,9 +261,9 @@ static void objects_dfs (FILE *f, void *obj_content) {
   void *obj_header = get_obj_header_ptr(obj_content);
   data *obj_data   = TO_DATA(obj_content);
   // internal mark-bit for this dfs, should be recovered by the caller
-  if ((obj_data->forward_address & 2) != 0) { return; }
+  if ((obj_data->id & DFS_VISITED_BIT) != 0) { return; }
   // set this bit as 1
-  obj_data->forward_address |= 2;
+  obj_data->id |= DFS_VISITED_BIT;
   fprintf(f, "object at addr %p: ", obj_content);
   print_object_info(f, obj_content);
   /*fprintf(f, "object id: %zu | ", obj_data->id);*/
@@ -136,7 +295,7 @@ FILE *print_objects_traversal (char *filename, bool marked) {
        heap_next_obj_iterator(&it)) {
     void *obj_header = it.current;
     data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
-    if ((obj_data->forward_address & 1) == marked) {
+    if (is_marked(get_object_content_ptr(obj_header)) == marked) {
       objects_dfs(f, get_object_content_ptr(obj_header));
     }
   }
@@ -146,7 +305,7 @@ FILE *print_objects_traversal (char *filename, bool marked) {
        heap_next_obj_iterator(&it)) {
     void *obj_header = it.current;
     data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
-    obj_data->forward_address &= (~2);
+    obj_data->id &= ~DFS_VISITED_BIT;
   }
   fflush(f);
 
@@ -172,20 +331,262 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
+static void *gc_alloc_on_nursery (size_t size) {
+  if (nursery.current + size <= nursery.end) {
+    void *p = (void *)nursery.current;
+    nursery.current += size;
+    return p;
+  }
+  return NULL;
+}
+
+static void *gc_alloc_on_leaf_space (size_t size) {
+  if (leaf_space.current + size <= leaf_space.end) {
+    void *p = (void *)leaf_space.current;
+    leaf_space.current += size;
+    return p;
+  }
+  return NULL;
+}
+
+static void reserve_object_starts (size_t heap_size) {
+  size_t capacity = heap_size / REGION_SIZE + 1;
+  if (capacity <= object_starts_capacity) { return; }
+  object_starts = realloc(object_starts, capacity * sizeof(size_t));
+  if (object_starts == NULL) {
+    perror("ERROR: reserve_object_starts: realloc failed\n");
+    exit(1);
+  }
+  object_starts_capacity = capacity;
+}
+
+// has to be called for each object [obj, obj + size) placed into the old space
+static inline void record_object_start (size_t *obj, size_t size) {
+  size_t offset = obj - heap.begin;
+  for (size_t i = (offset + REGION_SIZE - 1) / REGION_SIZE; i * REGION_SIZE < offset + size; ++i) {
+    object_starts[i] = offset;
+  }
+}
+
+// the bitmap has to cover size words, new bits are clear
+static void reserve_mark_bitmap (mark_bitmap *bm, size_t size) {
+  size_t words = size / MARK_WORD_BITS + 2;
+  if (words <= bm->size) { return; }
+  bm->bits    = realloc(bm->bits, words * sizeof(uint32_t));
+  bm->offsets = realloc(bm->offsets, words * sizeof(size_t));
+  if (bm->bits == NULL || bm->offsets == NULL) {
+    perror("ERROR: reserve_mark_bitmap: realloc failed\n");
+    exit(1);
+  }
+  memset(bm->bits + bm->size, 0, (words - bm->size) * sizeof(uint32_t));
+  bm->size = words;
+}
+
+static void free_mark_bitmap (mark_bitmap *bm) {
+  free(bm->bits);
+  free(bm->offsets);
+  bm->bits    = NULL;
+  bm->offsets = NULL;
+  bm->size    = 0;
+}
+
+// number of bitmap words to look at for a chunk with size used words, including the word of the
+// end of the chunk
+static inline size_t bitmap_words (size_t size) { return size / MARK_WORD_BITS + 1; }
+
+// returns the bitmap of the chunk containing the object and the index of its header in it, or NULL
+// for a large object
+static inline mark_bitmap *object_bitmap (void *obj, size_t *idx) {
+  size_t *header_ptr = (size_t *)TO_DATA(obj);
+  if (nursery.begin <= header_ptr && header_ptr < nursery.end) {
+    *idx = header_ptr - nursery.begin;
+    return &nursery_marks;
+  }
+  if (heap.begin <= header_ptr && header_ptr < heap.end) {
+    *idx = header_ptr - heap.begin;
+    return &heap_marks;
+  }
+  if (leaf_space.begin <= header_ptr && header_ptr < leaf_space.end) {
+    *idx = header_ptr - leaf_space.begin;
+    return &leaf_marks;
+  }
+  return NULL;
+}
+
+// bits [from, to) which lie in the w-th word of a bitmap
+static inline uint32_t mark_word_mask (size_t w, size_t from, size_t to) {
+  size_t lo = MAX(from, w * MARK_WORD_BITS) - w * MARK_WORD_BITS;
+  size_t hi = MIN(to, (w + 1) * MARK_WORD_BITS) - w * MARK_WORD_BITS;
+  return (hi == MARK_WORD_BITS ? ~0u : (1u << hi) - 1) & ~((1u << lo) - 1);
+}
+
+static inline void set_mark_bits (uint32_t *bits, size_t from, size_t count, bool value) {
+  for (size_t w = from / MARK_WORD_BITS; w * MARK_WORD_BITS < from + count; ++w) {
+    uint32_t mask = mark_word_mask(w, from, from + count);
+    if (value) {
+      bits[w] |= mask;
+    } else {
+      bits[w] &= ~mask;
+    }
+  }
+}
+
+// words of neighbouring objects may be marked by other threads at the same time
+static inline void atomic_set_mark_bits (uint32_t *bits, size_t from, size_t count) {
+  for (size_t w = from / MARK_WORD_BITS; w * MARK_WORD_BITS < from + count; ++w) {
+    __atomic_fetch_or(&bits[w], mark_word_mask(w, from, from + count), __ATOMIC_RELAXED);
+  }
+}
+
+// returns the index of the first marked word in [from, to) or to; clear bitmap words are skipped
+// at once
+static inline size_t next_marked (const mark_bitmap *bm, size_t from, size_t to) {
+  if (from >= to) { return to; }
+  size_t   w    = from / MARK_WORD_BITS;
+  uint32_t bits = bm->bits[w] & (~0u << (from % MARK_WORD_BITS));
+  while (bits == 0) {
+    if (++w * MARK_WORD_BITS >= to) { return to; }
+    bits = bm->bits[w];
+  }
+  return MIN(w * MARK_WORD_BITS + __builtin_ctz(bits), to);
+}
+
+// returns the index of the first clear bit in [from, to) or to
+static inline size_t next_unmarked (const mark_bitmap *bm, size_t from, size_t to) {
+  if (from >= to) { return to; }
+  size_t   w    = from / MARK_WORD_BITS;
+  uint32_t bits = ~bm->bits[w] & (~0u << (from % MARK_WORD_BITS));
+  while (bits == 0) {
+    if (++w * MARK_WORD_BITS >= to) { return to; }
+    bits = ~bm->bits[w];
+  }
+  return MIN(w * MARK_WORD_BITS + __builtin_ctz(bits), to);
+}
+
+// header of the first live object in [p, end) of the chunk beginning at space, or end
+static inline size_t *next_live (const mark_bitmap *bm, size_t *space, size_t *p, size_t *end) {
+  return space + next_marked(bm, p - space, end - space);
+}
+
+// fills offsets of bitmap words [from, to) counting live words from base, returns the number of
+// live words up to the to-th bitmap word plus base
+static size_t count_live_words (mark_bitmap *bm, size_t from, size_t to, size_t base) {
+  for (size_t w = from; w < to; ++w) {
+    bm->offsets[w] = base;
+    base += __builtin_popcount(bm->bits[w]);
+  }
+  return base;
+}
+
+// number of live words before the idx-th word of the chunk plus the base of the chunk; this is the
+// new offset of a live object from heap.begin, no object header is read
+static inline size_t live_before (const mark_bitmap *bm, size_t idx) {
+  uint32_t below = bm->bits[idx / MARK_WORD_BITS] & ((1u << (idx % MARK_WORD_BITS)) - 1);
+  return bm->offsets[idx / MARK_WORD_BITS] + __builtin_popcount(below);
+}
+
+// takes a pointer to the content of a large object
+static inline large_object *to_large_object (void *obj) { return (large_object *)TO_DATA(obj) - 1; }
+
+// returns the large object containing the address or NULL
+static large_object *large_object_of (const void *p) {
+  if (large_objects.size == 0) { return NULL; }
+  // the last object beginning not after p
+  size_t lo = 0, hi = large_objects.size;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if ((void *)large_objects.objs[mid] <= p) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  large_object *obj = large_objects.objs[lo];
+  return (void *)obj <= p && p < (void *)obj + obj->size ? obj : NULL;
+}
+
+static inline bool is_large (const size_t *p) { return !UNBOXED(p) && large_object_of(p) != NULL; }
+
+void *alloc_large (size_t size) {
+  // the large object space may grow by the size of the old space between full collections
+  if (large_allocated >= heap.size) {
+    unsigned long long start = gc_clock();
+    full_collection(0);
+    record_pause(start);
+  }
+  size_t        bytes = sizeof(large_object) + WORDS_TO_BYTES(size);
+  large_object *obj   = mmap(
+      NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (obj == MAP_FAILED) {
+    fprintf(stderr, "Out of memory: cannot allocate an object of %zu bytes\n", WORDS_TO_BYTES(size));
+    exit(1);
+  }
+  obj->size   = bytes;
+  obj->marked = 0;
+
+  if (large_objects.size == large_objects.capacity) {
+    large_objects.capacity = MAX(2 * large_objects.capacity, LARGE_OBJECTS_INIT_CAPACITY);
+    large_objects.objs =
+        realloc(large_objects.objs, large_objects.capacity * sizeof(large_object *));
+    if (large_objects.objs == NULL) {
+      perror("ERROR: alloc_large: realloc failed\n");
+      exit(1);
+    }
+  }
+  size_t i = large_objects.size++;
+  for (; i > 0 && large_objects.objs[i - 1] > obj; --i) {
+    large_objects.objs[i] = large_objects.objs[i - 1];
+  }
+  large_objects.objs[i] = obj;
+  large_allocated += size;
+  // the memory is already zeroed by mmap
+  return obj + 1;
+}
+
+// unmaps unmarked large objects and unmarks the others
+static void sweep_large_objects (void) {
+  size_t live = 0;
+  for (size_t i = 0; i < large_objects.size; ++i) {
+    large_object *obj = large_objects.objs[i];
+    if (obj->marked) {
+      obj->marked                = 0;
+      large_objects.objs[live++] = obj;
+    } else {
+      munmap(obj, obj->size);
+    }
+  }
+  large_objects.size = live;
+  large_allocated    = 0;
+}
+
 void *gc_alloc_on_existing_heap (size_t size) {
+  if (compaction == MARK_REGION_COMPACTION) {
+    size_t *p = alloc_in_holes(size);
+    if (p != NULL) { return p; }
+  }
   if (heap.current + size <= heap.end) {
     void *p = (void *)heap.current;
+    record_object_start(heap.current, size);
     heap.current += size;
-    memset(p, 0, size * sizeof(size_t));
     return p;
   }
   return NULL;
 }
 
-void *gc_alloc (size_t size) {
+// marks and compacts both the old space and the nursery, after that the nursery is empty
+static void full_collection (size_t additional_size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
+  ++gc_stats.full_collections;
+  unsigned long long start = gc_clock();
+  count_young_words();
+  if (mutator_start != 0) {
+    // pauses of minor collections and marking slices are not the mutator time
+    long long gc_time = gc_stats.total_pause - pause_at_mutator_start;
+    long long mutator = (long long)(start - mutator_start) - gc_time;
+    if (mutator > 0) { alloc_rate = (double)allocated_words / mutator; }
+  }
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_before = print_stack_content("stack-dump-before-compaction");
   FILE *heap_before  = print_objects_traversal("before-mark", 0);
@@ -196,7 +597,15 @@ void *gc_alloc (size_t size) {
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
-  compact_phase(size);
+  compact_phase(additional_size);
+  unsigned long long end  = gc_clock();
+  size_t             used = (heap.current - heap.begin) + (leaf_space.current - leaf_space.begin);
+  double             cost = (double)(end - start) / MAX(used, 1);
+  gc_cost_per_word        = gc_cost_per_word == 0 ? cost : (gc_cost_per_word + cost) / 2;
+  mutator_start           = end;
+  // the pause of this collection is recorded by the caller
+  pause_at_mutator_start = gc_stats.total_pause + (end - start);
+  allocated_words        = 0;
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -219,16 +628,62 @@ void *gc_alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has finished\n");
 #endif
+}
+
+void *gc_alloc (size_t size) {
+  full_collection(size);
   return gc_alloc_on_existing_heap(size);
 }
 
+// the leaf space is sized by compact_phase from its live data, it grows further if the object still
+// does not fit
+static void *gc_alloc_leaf (size_t size) {
+  full_collection(0);
+  size_t needed = leaf_space.current - leaf_space.begin + size;
+  if (needed > leaf_space.size) {
+    if (needed > leaf_space.reserved) {
+      fprintf(stderr,
+              "Out of memory: %zu bytes of strings do not fit into the leaf space of %zu bytes\n",
+              WORDS_TO_BYTES(needed),
+              WORDS_TO_BYTES(leaf_space.reserved));
+      exit(1);
+    }
+    commit_chunk(&leaf_space, MIN(needed * EXTRA_ROOM_HEAP_COEFFICIENT, leaf_space.reserved));
+    reserve_mark_bitmap(&leaf_marks, leaf_space.size);
+  }
+  return gc_alloc_on_leaf_space(size);
+}
+
 static void gc_root_scan_stack () {
   for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
     gc_test_and_mark_root((size_t **)p);
   }
 }
 
+// in words, including the nursery
+static inline size_t heap_used_size (void) {
+  return (heap.current - heap.begin) + (nursery.current - nursery.begin);
+}
+
+static inline size_t *next_object (size_t *header_ptr) {
+  return header_ptr + BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+}
+
+static void finish_incremental_marking (void);
+
 void mark_phase (void) {
+  if (incremental_marking) {
+    finish_incremental_marking();
+    return;
+  }
+  if (compaction == MARK_REGION_COMPACTION) {
+    mark_region_trace();
+    return;
+  }
+  if (gc_threads > 1 && heap_used_size() >= PARALLEL_MARK_MIN_HEAP) {
+    parallel_mark_phase(gc_threads);
+    return;
+  }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has started\n");
   fprintf(stderr,
@@ -255,54 +710,185 @@ void mark_phase (void) {
 #endif
 }
 
-void compact_phase (size_t additional_size) {
-  size_t live_size = compute_locations();
+// in words; the old space must be able to accept all survivors of the next minor collection.
+// Without a time target the heap is a fixed multiple of live data. With it, the next collection
+// is assumed to cost as much per live word as the previous ones, and the heap gets enough free
+// space for the mutator to run (1 - target) / target times longer at the measured allocation rate
+static size_t next_heap_size (size_t live_size, size_t additional_size) {
+  size_t needed = live_size + additional_size;
+  if (needed > heap_max_size) {
+    fprintf(stderr,
+            "Out of memory: %zu bytes of live data do not fit into the heap limit of %zu bytes\n",
+            WORDS_TO_BYTES(needed),
+            WORDS_TO_BYTES(heap_max_size));
+    exit(1);
+  }
+  size_t size;
+  if (gc_time_target != 0 && gc_cost_per_word != 0 && alloc_rate != 0) {
+    double gc_time = gc_cost_per_word * live_size;
+    double free    = alloc_rate * gc_time * (1 - gc_time_target) / gc_time_target;
+    size           = needed + nursery.size + (size_t)MIN(free, (double)heap_max_size);
+  } else {
+    size = live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size + nursery.size;
+  }
+  size = MAX(size, MAX(heap_initial_size, MINIMUM_HEAP_CAPACITY));
+  // the heap shrinks only when it is mostly empty, so that its size does not jump back and forth
+  if (size < heap.size && size * HEAP_SHRINK_RATIO > heap.size) { size = heap.size; }
+  return MIN(size, heap_max_size);
+}
 
-  // all in words
-  size_t next_heap_size =
-      MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
-  size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
+// in words; the leaf space is a fixed multiple of its live data and shrinks like the old space,
+// like the old space it has room for the survivors of the next minor collection
+static size_t next_leaf_space_size (size_t live_size) {
+  if (live_size > leaf_space.reserved) {
+    fprintf(stderr,
+            "Out of memory: %zu bytes of strings do not fit into the leaf space of %zu bytes\n",
+            WORDS_TO_BYTES(live_size),
+            WORDS_TO_BYTES(leaf_space.reserved));
+    exit(1);
+  }
+  size_t size = live_size * EXTRA_ROOM_HEAP_COEFFICIENT + nursery.size;
+  size        = MAX(size, MAX(heap_initial_size, MINIMUM_HEAP_CAPACITY));
+  if (size < leaf_space.size && size * HEAP_SHRINK_RATIO > leaf_space.size) {
+    size = leaf_space.size;
+  }
+  return MIN(size, leaf_space.reserved);
+}
 
+void compact_phase (size_t additional_size) {
+  if (compaction == MARK_REGION_COMPACTION) {
+    mark_region_sweep(additional_size);
+    return;
+  }
+  bool depth_first = compaction == DEPTH_FIRST_COMPACTION;
+  bool parallel    = compaction == SLIDING_COMPACTION && gc_threads > 1
+                  && heap_used_size() >= PARALLEL_COMPACT_MIN_HEAP;
+  size_t live_size = depth_first ? dfs_compute_locations()
+                     : parallel  ? parallel_compute_locations(gc_threads)
+                                 : compute_locations();
+  size_t next_size = next_heap_size(live_size, additional_size);
+  size_t next_leaf = next_leaf_space_size(leaf_live_size);
+
+  // bounds of the old space before compaction, the leaf space keeps its bounds until the end
   memory_chunk old_heap = heap;
-  heap.begin            = mremap(
-      heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(next_heap_pseudo_size), MREMAP_MAYMOVE);
-  if (heap.begin == MAP_FAILED) {
-    perror("ERROR: compact_phase: mremap failed\n");
-    exit(1);
+  // survivors of the nursery may go beyond the current end, spaces shrink after moving objects
+  commit_chunk(&heap, MAX(next_size, heap.size));
+  commit_chunk(&leaf_space, MAX(next_leaf, leaf_space.size));
+  reserve_object_starts(heap.size);
+  reserve_mark_bitmap(&heap_marks, heap.size);
+  reserve_mark_bitmap(&leaf_marks, leaf_space.size);
+
+  if (depth_first) {
+    dfs_update_references(&old_heap);
+    dfs_physically_relocate(&old_heap);
+  } else if (parallel) {
+    parallel_update_references(&old_heap, gc_threads);
+    parallel_physically_relocate(&old_heap, gc_threads);
+  } else if (compaction == SINGLE_PASS_COMPACTION) {
+    single_pass_compact(&old_heap);
+  } else {
+    update_references(&old_heap);
+    physically_relocate(&old_heap);
   }
-  heap.end     = heap.begin + next_heap_pseudo_size;
-  heap.size    = next_heap_pseudo_size;
-  heap.current = heap.begin + (old_heap.current - old_heap.begin);
 
-  update_references(&old_heap);
-  physically_relocate(&old_heap);
+  memset(heap_marks.bits, 0, bitmap_words(old_heap.current - old_heap.begin) * sizeof(uint32_t));
+  memset(leaf_marks.bits,
+         0,
+         bitmap_words(leaf_space.current - leaf_space.begin) * sizeof(uint32_t));
+  memset(nursery_marks.bits, 0, bitmap_words(nursery.current - nursery.begin) * sizeof(uint32_t));
+  if (young_forwards != NULL) {
+    memset(young_forwards, 0, WORDS_TO_BYTES(nursery.current - nursery.begin));
+  }
+  heap.current       = heap.begin + live_size;
+  leaf_space.current = leaf_space.begin + leaf_live_size;
+  if (next_size < heap.size) { commit_chunk(&heap, next_size); }
+  if (next_leaf < leaf_space.size) { commit_chunk(&leaf_space, next_leaf); }
+  sweep_large_objects();
+  // all live young objects have been moved to the old space or to the leaf space
+  nursery.current = nursery.begin;
+  remembered.size = 0;
+}
 
-  heap.current = heap.begin + live_size;
+// objects without pointer fields, they are kept in the leaf space
+static inline bool is_leaf_object (void *header_ptr) {
+  return get_type_header_ptr(header_ptr) == STRING;
 }
 
-size_t compute_locations () {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC compute_locations started\n");
-#endif
-  size_t       *free_ptr  = heap.begin;
-  heap_iterator scan_iter = heap_begin_iterator();
+// new content of a young object moved by the current full collection or NULL
+static inline void *young_forward (void *obj) {
+  return (void *)young_forwards[(size_t *)TO_DATA(obj) - nursery.begin];
+}
+
+static inline void set_young_forward (void *obj, void *content) {
+  young_forwards[(size_t *)TO_DATA(obj) - nursery.begin] = (size_t)content;
+}
 
-  for (; !heap_is_done_iterator(&scan_iter); heap_next_obj_iterator(&scan_iter)) {
-    void *header_ptr  = scan_iter.current;
-    void *obj_content = get_object_content_ptr(header_ptr);
-    if (is_marked(obj_content)) {
-      size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
-      // forward address is responsible for object header pointer
-      set_forward_address(obj_content, (size_t)free_ptr);
-      free_ptr += sz;
+// young survivors go right after survivors from the old space or from the leaf space; the nursery
+// is small, so their new contents are kept in young_forwards. Takes and returns live sizes of both
+// spaces in words
+static void forward_young_objects (size_t *live_size, size_t *leaf_size) {
+  for (size_t *p = next_live(&nursery_marks, nursery.begin, nursery.begin, nursery.current), *next;
+       p < nursery.current;
+       p = next_live(&nursery_marks, nursery.begin, next, nursery.current)) {
+    next = next_object(p);
+    size_t *to;
+    if (is_leaf_object(p)) {
+      to = leaf_space.begin + *leaf_size;
+      *leaf_size += next - p;
+    } else {
+      to = heap.begin + *live_size;
+      *live_size += next - p;
     }
+    set_young_forward(get_object_content_ptr(p), (void *)to + DATA_HEADER_SZ);
   }
+}
 
+size_t compute_locations () {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC compute_locations started\n");
+#endif
+  size_t live_size = count_live_words(&heap_marks, 0, bitmap_words(heap.current - heap.begin), 0);
+  leaf_live_size   = count_live_words(
+      &leaf_marks, 0, bitmap_words(leaf_space.current - leaf_space.begin), 0);
+  forward_young_objects(&live_size, &leaf_live_size);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations finished\n");
 #endif
   // it will return number of words
-  return free_ptr - heap.begin;
+  return live_size;
+}
+
+static inline bool is_young (const size_t *p) {
+  return !UNBOXED(p) && (size_t)nursery.begin < (size_t)p && (size_t)p <= (size_t)nursery.current;
+}
+
+static inline bool is_old (const size_t *p) {
+  return !UNBOXED(p) && (size_t)heap.begin < (size_t)p && (size_t)p <= (size_t)heap.current;
+}
+
+static inline bool is_leaf (const size_t *p) {
+  return !UNBOXED(p) && (size_t)leaf_space.begin < (size_t)p
+         && (size_t)p <= (size_t)leaf_space.current;
+}
+
+// ptr_value is a pointer to an object content either in the old space before compaction, in the
+// leaf space or in the nursery, returns the new address of the content or NULL if ptr_value is not
+// a heap pointer
+static void *relocated_content (memory_chunk *old_heap, size_t ptr_value) {
+  size_t *header_ptr = (size_t *)TO_DATA(ptr_value);
+  if (old_heap->begin <= header_ptr && header_ptr < old_heap->current) {
+    if (compaction == DEPTH_FIRST_COMPACTION) {
+      return (void *)get_forward_address((void *)ptr_value);
+    }
+    return (void *)(heap.begin + live_before(&heap_marks, header_ptr - old_heap->begin))
+           + DATA_HEADER_SZ;
+  }
+  if (is_leaf((size_t *)ptr_value)) {
+    return (void *)(leaf_space.begin + live_before(&leaf_marks, header_ptr - leaf_space.begin))
+           + DATA_HEADER_SZ;
+  }
+  if (is_young((size_t *)ptr_value)) { return young_forward((void *)ptr_value); }
+  return NULL;
 }
 
 void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
@@ -313,14 +899,9 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
     size_t ptr_value = *ptr;
     // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
     // heap
-    if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
-        && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
-    }
+    if (!is_valid_pointer((size_t *)ptr_value)) { continue; }
+    void *new_content = relocated_content(old_heap, ptr_value);
+    if (new_content != NULL) { *(void **)ptr = new_content; }
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region finished\n");
@@ -378,12 +959,9 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
       continue;
     }
-    if ((size_t)old_heap->begin <= ptr_value && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+    void *new_content = relocated_content(old_heap, ptr_value);
+    if (new_content != NULL) {
+      *(void **)ptr = new_content;
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr,
               "|\textra root (%p) %p -> %p\n",
@@ -398,45 +976,32 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
-void update_references (memory_chunk *old_heap) {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC update_references started\n");
-#endif
-  heap_iterator it = heap_begin_iterator();
-  while (!heap_is_done_iterator(&it)) {
-    if (is_marked(get_object_content_ptr(it.current))) {
-      for (obj_field_iterator field_iter = ptr_field_begin_iterator(it.current);
-           !field_is_done_iterator(&field_iter);
-           obj_next_ptr_field_iterator(&field_iter)) {
-
-        size_t *field_value = *(size_t **)field_iter.cur_field;
-        if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
-        // this pointer should also be modified according to old_heap->begin
-        void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
-        // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
-        void *new_addr =
-            heap.begin
-            + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
-        // update field reference to point to new_addr
-        // since, we want fields to point to an actual content, we need to add this extra content_offset
-        // because forward_address itself is a pointer to the object's header
-        size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
+static void update_object_references (memory_chunk *old_heap, void *header_ptr) {
+  for (obj_field_iterator field_iter = ptr_field_begin_iterator(header_ptr);
+       !field_is_done_iterator(&field_iter);
+       obj_next_ptr_field_iterator(&field_iter)) {
+
+    // important, we calculate new address very carefully here, because objects may relocate to another memory
+    // chunk, and fields may point into the nursery
+    void *new_content = relocated_content(old_heap, *(size_t *)field_iter.cur_field);
+    if (new_content == NULL) { continue; }
 #ifdef DEBUG_VERSION
-        if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
+    // survivors from the nursery are moved beyond the current ends of the spaces
+    if ((new_content <= (void *)heap.begin || new_content > (void *)heap.end)
+        && (new_content <= (void *)leaf_space.begin || new_content > (void *)leaf_space.end)) {
 #  ifdef DEBUG_PRINT
-          fprintf(stderr,
-                  "ur: incorrect pointer assignment: on object with id %d",
-                  TO_DATA(get_object_content_ptr(it.current))->id);
+      fprintf(stderr,
+              "ur: incorrect pointer assignment: on object with id %d",
+              TO_DATA(get_object_content_ptr(header_ptr))->id);
 #  endif
-          exit(1);
-        }
-#endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
-      }
+      exit(1);
     }
-    heap_next_obj_iterator(&it);
+#endif
+    *(void **)field_iter.cur_field = new_content;
   }
+}
+
+static void update_root_references (memory_chunk *old_heap) {
   // fix pointers from stack
   scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
 
@@ -447,90 +1012,882 @@ void update_references (memory_chunk *old_heap) {
   assert((void *)&__stop_custom_data >= (void *)&__start_custom_data);
   scan_and_fix_region(old_heap, (void *)&__start_custom_data, (void *)&__stop_custom_data);
 #endif
+}
+
+// objects [begin, end) belong to the chunk beginning at space
+static void update_live_references (memory_chunk *old_heap, const mark_bitmap *bm, size_t *space,
+                                    size_t *begin, size_t *end) {
+  for (size_t *p = next_live(bm, space, begin, end); p < end;
+       p = next_live(bm, space, next_object(p), end)) {
+    update_object_references(old_heap, p);
+  }
+}
+
+// large objects are not moved, but their fields are updated
+static void update_large_object_references (memory_chunk *old_heap) {
+  for (size_t i = 0; i < large_objects.size; ++i) {
+    large_object *obj = large_objects.objs[i];
+    if (obj->marked) { update_object_references(old_heap, obj + 1); }
+  }
+}
+
+void update_references (memory_chunk *old_heap) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC update_references started\n");
+#endif
+  update_live_references(old_heap, &heap_marks, heap.begin, heap.begin, heap.current);
+  update_live_references(old_heap, &nursery_marks, nursery.begin, nursery.begin, nursery.current);
+  update_large_object_references(old_heap);
+  update_root_references(old_heap);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC update_references finished\n");
 #endif
 }
 
+// moves live objects [begin, end) of the chunk beginning at space to their new locations, the
+// chunk slides within itself
+static void slide_live_objects (const mark_bitmap *bm, size_t *space, size_t *begin, size_t *end) {
+  for (size_t *p = next_live(bm, space, begin, end), *next; p < end;
+       p = next_live(bm, space, next, end)) {
+    next       = next_object(p);
+    size_t *to = space + live_before(bm, p - space);
+    memmove(to, p, WORDS_TO_BYTES(next - p));
+    if (space == heap.begin) { record_object_start(to, next - p); }
+  }
+}
+
+// moves live young objects to their forward addresses; with leaves_only the others are already
+// copied, and objects which are marked but not reached by the depth-first traversal are dropped
+static void move_young_objects (bool leaves_only) {
+  for (size_t *p = next_live(&nursery_marks, nursery.begin, nursery.begin, nursery.current), *next;
+       p < nursery.current;
+       p = next_live(&nursery_marks, nursery.begin, next, nursery.current)) {
+    next          = next_object(p);
+    void *content = young_forward(get_object_content_ptr(p));
+    if (leaves_only && (!is_leaf_object(p) || content == NULL)) { continue; }
+    size_t *to = (size_t *)TO_DATA(content);
+    memcpy(to, p, WORDS_TO_BYTES(next - p));
+    if (heap.begin <= to && to < heap.end) { record_object_start(to, next - p); }
+  }
+}
+
 void physically_relocate (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate started\n");
 #endif
-  heap_iterator from_iter = heap_begin_iterator();
+  // spaces go first, so survivors from the nursery never overwrite unmoved objects
+  slide_live_objects(&heap_marks, heap.begin, heap.begin, heap.current);
+  slide_live_objects(&leaf_marks, leaf_space.begin, leaf_space.begin, leaf_space.current);
+  move_young_objects(false);
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC physically_relocate finished\n");
+#endif
+}
+
+// layouts of objects indexed by TAG (header), the single-pass compactor gets sizes and pointer
+// fields of objects from them instead of get_type_header_ptr
+typedef struct {
+  size_t elem_size;      // bytes per unit of LEN
+  size_t extra_size;     // bytes of the content besides the elements
+  size_t first_field;    // words from the content to the first field which may be a pointer
+  bool   has_pointers;   // fields from the first one to the end of the object may be pointers
+} object_layout;
+
+static const object_layout object_layouts[] = {
+    [STRING_TAG]  = {1, 1, 0, false},
+    [ARRAY_TAG]   = {MEMBER_SIZE, 0, 0, true},
+    [SEXP_TAG]    = {MEMBER_SIZE, MEMBER_SIZE, 1, true},   // the first word is the tag
+    [CLOSURE_TAG] = {MEMBER_SIZE, 0, 1, true},             // the first word is the code
+    [CONS_TAG]    = {MEMBER_SIZE, 0, 0, true},
+};
+
+// updates pointer fields of the live object p and moves it to, returns the end of the object at its
+// old place. New addresses come from the bitmaps and from forward addresses of young objects, so
+// they do not depend on whether the target has been moved already
+static inline size_t *update_and_move_object (memory_chunk *old_heap, size_t *p, size_t *to) {
+  int                  header = *(int *)p;
+  const object_layout *layout = &object_layouts[TAG(header)];
+  size_t               bytes
+      = DATA_HEADER_SZ + LEN(header) * layout->elem_size + layout->extra_size;
+  size_t *end = p + BYTES_TO_WORDS(bytes);
+  if (layout->has_pointers) {
+    for (size_t *f = (size_t *)((char *)p + DATA_HEADER_SZ) + layout->first_field; f < end; ++f) {
+      if (UNBOXED(*f)) { continue; }
+      void *new_content = relocated_content(old_heap, *f);
+      if (new_content != NULL) { *f = (size_t)new_content; }
+    }
+  }
+  memmove(to, p, WORDS_TO_BYTES(end - p));
+  return end;
+}
+
+// the same as slide_live_objects, but fields of objects are updated on the way. Objects are visited
+// in the increasing order and never move up, so an object is updated before anything is written
+// over it
+static void update_and_slide_live_objects (memory_chunk *old_heap, const mark_bitmap *bm,
+                                           size_t *space, size_t *end) {
+  for (size_t *p = next_live(bm, space, space, end), *next; p < end;
+       p = next_live(bm, space, next, end)) {
+    size_t *to = space + live_before(bm, p - space);
+    next       = update_and_move_object(old_heap, p, to);
+    if (space == heap.begin) { record_object_start(to, next - p); }
+  }
+}
+
+// young survivors go beyond all objects of the old space and of the leaf space, so they are moved
+// last
+void single_pass_compact (memory_chunk *old_heap) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC single_pass_compact started\n");
+#endif
+  update_large_object_references(old_heap);
+  update_root_references(old_heap);
+  update_and_slide_live_objects(old_heap, &heap_marks, heap.begin, heap.current);
+  update_and_slide_live_objects(old_heap, &leaf_marks, leaf_space.begin, leaf_space.current);
+  for (size_t *p = next_live(&nursery_marks, nursery.begin, nursery.begin, nursery.current), *next;
+       p < nursery.current;
+       p = next_live(&nursery_marks, nursery.begin, next, nursery.current)) {
+    size_t *to = (size_t *)TO_DATA(young_forward(get_object_content_ptr(p)));
+    next       = update_and_move_object(old_heap, p, to);
+    if (heap.begin <= to && to < heap.end) { record_object_start(to, next - p); }
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC single_pass_compact finished\n");
+#endif
+}
+
+// runs task in the calling thread and in threads - 1 new ones, tasks take regions one by one in
+// the increasing order
+static void run_region_task (int threads, void *(*task) (void *), void *arg) {
+  pthread_t thread[MAX_GC_THREADS];
+  bool      started[MAX_GC_THREADS];
+  next_region = 0;
+  // if a thread has not started, others do its work
+  for (int i = 1; i < threads; ++i) {
+    started[i] = pthread_create(&thread[i], NULL, task, arg) == 0;
+  }
+  task(arg);
+  for (int i = 1; i < threads; ++i) {
+    if (started[i]) { pthread_join(thread[i], NULL); }
+  }
+}
+
+static inline compaction_region *take_region (void) {
+  size_t i = __atomic_fetch_add(&next_region, 1, __ATOMIC_RELAXED);
+  return i < regions_number ? &regions[i] : NULL;
+}
+
+// bitmap words counted for the region: the aligned part of the old space of REGION_SIZE words.
+// They do not match the objects of the region, only their sum matters
+static inline void region_bitmap_words (compaction_region *r, size_t *from, size_t *to) {
+  size_t i = r - regions;
+  *from    = i * (REGION_SIZE / MARK_WORD_BITS);
+  *to      = i + 1 == regions_number ? bitmap_words(heap.current - heap.begin)
+                                     : *from + REGION_SIZE / MARK_WORD_BITS;
+}
+
+static void *count_live_task (void *arg) {
+  for (compaction_region *r; (r = take_region()) != NULL;) {
+    size_t from, to;
+    region_bitmap_words(r, &from, &to);
+    r->live = 0;
+    for (size_t w = from; w < to; ++w) { r->live += __builtin_popcount(heap_marks.bits[w]); }
+  }
+  return NULL;
+}
+
+static void *compute_locations_task (void *arg) {
+  for (compaction_region *r; (r = take_region()) != NULL;) {
+    size_t from, to;
+    region_bitmap_words(r, &from, &to);
+    count_live_words(&heap_marks, from, to, r->dest);
+  }
+  return NULL;
+}
 
-  while (!heap_is_done_iterator(&from_iter)) {
-    void         *obj       = get_object_content_ptr(from_iter.current);
-    heap_iterator next_iter = from_iter;
-    heap_next_obj_iterator(&next_iter);
-    if (is_marked(obj)) {
-      // Move the object from its old location to its new location relative to
-      // the heap's (possibly new) location, 'to' points to future object header
-      size_t *to = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
-      memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
-      unmark_object(get_object_content_ptr(to));
+size_t parallel_compute_locations (int threads) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_compute_locations started: %d threads\n", threads);
+#endif
+  regions_number = (heap.current - heap.begin + REGION_SIZE - 1) / REGION_SIZE;
+  if (regions_number > regions_capacity) {
+    regions_capacity = regions_number;
+    regions          = realloc(regions, regions_capacity * sizeof(compaction_region));
+    if (regions == NULL) {
+      perror("ERROR: parallel_compute_locations: realloc failed\n");
+      exit(1);
     }
-    from_iter = next_iter;
   }
+  for (size_t i = 0; i < regions_number; ++i) {
+    size_t *begin = heap.begin + object_starts[i];
+    // the object covering the beginning of the region belongs to the previous one
+    if (begin < heap.begin + i * REGION_SIZE) { begin = next_object(begin); }
+    regions[i].begin = begin;
+    if (i > 0) { regions[i - 1].end = begin; }
+  }
+  if (regions_number > 0) { regions[regions_number - 1].end = heap.current; }
+
+  run_region_task(threads, count_live_task, NULL);
+  size_t live_size = 0;
+  for (size_t i = 0; i < regions_number; ++i) {
+    regions[i].dest = live_size;
+    regions[i].done = 0;
+    live_size += regions[i].live;
+  }
+  run_region_task(threads, compute_locations_task, NULL);
+  // now dest and live describe the objects of the regions
+  for (size_t i = 0; i < regions_number; ++i) {
+    regions[i].dest = live_before(&heap_marks, regions[i].begin - heap.begin);
+    regions[i].live = live_before(&heap_marks, regions[i].end - heap.begin) - regions[i].dest;
+  }
+  // the leaf space and the nursery are compacted by a single thread
+  leaf_live_size = count_live_words(
+      &leaf_marks, 0, bitmap_words(leaf_space.current - leaf_space.begin), 0);
+  forward_young_objects(&live_size, &leaf_live_size);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC physically_relocate finished\n");
+  fprintf(stderr, "GC parallel_compute_locations finished\n");
+#endif
+  return live_size;
+}
+
+static void *update_references_task (void *old_heap) {
+  for (compaction_region *r; (r = take_region()) != NULL;) {
+    update_live_references(old_heap, &heap_marks, heap.begin, r->begin, r->end);
+  }
+  return NULL;
+}
+
+void parallel_update_references (memory_chunk *old_heap, int threads) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_update_references started: %d threads\n", threads);
+#endif
+  run_region_task(threads, update_references_task, old_heap);
+  update_live_references(old_heap, &nursery_marks, nursery.begin, nursery.begin, nursery.current);
+  update_large_object_references(old_heap);
+  update_root_references(old_heap);
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_update_references finished\n");
+#endif
+}
+
+// objects of a region slide over objects of earlier regions, which have to be moved first
+static void wait_for_overwritten_regions (compaction_region *r) {
+  size_t  i          = r - regions;
+  size_t *dest_begin = heap.begin + r->dest;
+  size_t *dest_end   = dest_begin + r->live;
+  size_t  k          = MIN(r->dest / REGION_SIZE, i);
+  // the object covering dest_begin may belong to an earlier region
+  while (k > 0 && (k == i || regions[k].begin > dest_begin)) { --k; }
+  for (; k < i && regions[k].begin < dest_end; ++k) {
+    if (regions[k].end <= dest_begin) { continue; }
+    while (!__atomic_load_n(&regions[k].done, __ATOMIC_ACQUIRE)) { sched_yield(); }
+  }
+}
+
+static void *relocate_task (void *arg) {
+  for (compaction_region *r; (r = take_region()) != NULL;) {
+    if (r->live != 0) { wait_for_overwritten_regions(r); }
+    slide_live_objects(&heap_marks, heap.begin, r->begin, r->end);
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+void parallel_physically_relocate (memory_chunk *old_heap, int threads) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_physically_relocate started: %d threads\n", threads);
+#endif
+  run_region_task(threads, relocate_task, old_heap);
+  slide_live_objects(&leaf_marks, leaf_space.begin, leaf_space.begin, leaf_space.current);
+  move_young_objects(false);
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_physically_relocate finished\n");
+#endif
+}
+
+// objects of the old space and of the nursery are laid out by the traversal, each of them once
+static inline bool dfs_unvisited (void *obj) {
+  if (is_old(obj)) { return get_forward_address(obj) == 0; }
+  return is_young(obj) && young_forward(obj) == NULL;
+}
+
+// gives new addresses to objects reachable from obj in depth-first preorder and copies them to
+// dfs_copy, young leaf objects go to the leaf space. Fields are visited from the first one, so cells
+// of a list are laid out one after another
+static void dfs_forward (void *obj) {
+  mark_stack *st = &mark_workers[0].private_stack;
+  if (!dfs_unvisited(obj)) { return; }
+  mark_stack_push(st, obj);
+  while (st->size != 0) {
+    obj = st->objs[--st->size];
+    // an object may be pushed several times before it is visited
+    if (!dfs_unvisited(obj)) { continue; }
+    void  *header_ptr = get_obj_header_ptr(obj);
+    size_t size       = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+    bool   young      = is_young(obj);
+    if (young && is_leaf_object(header_ptr)) {
+      set_young_forward(obj, (void *)(leaf_space.begin + leaf_live_size) + DATA_HEADER_SZ);
+      leaf_live_size += size;
+      continue;
+    }
+    size_t *to          = dfs_copy + dfs_live_size;
+    void   *new_content = (void *)(heap.begin + dfs_live_size) + DATA_HEADER_SZ;
+    memcpy(to, header_ptr, WORDS_TO_BYTES(size));
+    // the header of an old object is overwritten, so fields are taken from the copy
+    if (young) {
+      set_young_forward(obj, new_content);
+    } else {
+      set_forward_address(obj, (size_t)new_content);
+    }
+    dfs_live_size += size;
+
+    size_t *first = field_begin_iterator(to).cur_field;
+    for (size_t *f = get_end_of_obj(to); f-- > first;) {
+      if (dfs_unvisited((void *)*f)) { mark_stack_push(st, (void *)*f); }
+    }
+  }
+}
+
+// forward addresses are used instead of the mark bitmaps of the old space and of the nursery;
+// objects which are marked but not reachable from roots (through a remembered slot of a dead
+// object) are dropped
+size_t dfs_compute_locations (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC dfs_compute_locations started\n");
+#endif
+  leaf_live_size = count_live_words(
+      &leaf_marks, 0, bitmap_words(leaf_space.current - leaf_space.begin), 0);
+
+  dfs_live_size = 0;
+  dfs_copy_size = MAX(heap_used_size(), 1);
+  dfs_copy      = mmap(NULL,
+                       WORDS_TO_BYTES(dfs_copy_size),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1,
+                       0);
+  if (dfs_copy == MAP_FAILED) {
+    perror("ERROR: dfs_compute_locations: mmap failed\n");
+    exit(1);
+  }
+
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    dfs_forward(*(void **)p);
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) { dfs_forward(*extra_roots.roots[i]); }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    dfs_forward(*(void **)p);
+  }
+#endif
+  // large objects are not moved, but objects reachable from them are
+  for (size_t i = 0; i < large_objects.size; ++i) {
+    large_object *obj = large_objects.objs[i];
+    if (!obj->marked) { continue; }
+    for (obj_field_iterator it = ptr_field_begin_iterator(obj + 1); !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      dfs_forward(*(void **)it.cur_field);
+    }
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC dfs_compute_locations finished\n");
 #endif
+  return dfs_live_size;
+}
+
+// objects are updated in the copy, forward addresses of originals are read until the copy is moved
+// back
+void dfs_update_references (memory_chunk *old_heap) {
+  for (size_t *p = dfs_copy, *next; p < dfs_copy + dfs_live_size; p = next) {
+    next = next_object(p);
+    record_object_start(heap.begin + (p - dfs_copy), next - p);
+    update_object_references(old_heap, p);
+  }
+  update_large_object_references(old_heap);
+  update_root_references(old_heap);
+}
+
+void dfs_physically_relocate (memory_chunk *old_heap) {
+  slide_live_objects(&leaf_marks, leaf_space.begin, leaf_space.begin, leaf_space.current);
+  move_young_objects(true);
+  memcpy(heap.begin, dfs_copy, WORDS_TO_BYTES(dfs_live_size));
+  munmap(dfs_copy, WORDS_TO_BYTES(dfs_copy_size));
+  dfs_copy = NULL;
+}
+
+void set_compaction_mode (compaction_mode mode) {
+  compaction = mode;
+  update_inline_allocation();
+}
+
+// headers of fillers have this tag, which is not a tag of any object, the rest of the header is the
+// size of the filler in words. Fillers cover dead runs and unused parts of holes, so that the old
+// space can still be walked object by object in the mark-region mode
+#define FILLER_TAG 0x00000000
+
+static inline bool is_filler (const size_t *header_ptr) {
+  return TAG(*(int *)header_ptr) == FILLER_TAG;
+}
+
+static inline void make_filler (size_t *p, size_t size) {
+  *(int *)p = (int)(size << 3) | FILLER_TAG;
+}
+
+// the rest of the current hole becomes a filler, allocation overwrites it
+static void seal_hole (void) {
+  if (hole_cursor < hole_limit) { make_filler(hole_cursor, hole_limit - hole_cursor); }
+}
+
+// bump allocation in holes of the mark-region mode, the memory is not cleared. Returns NULL if no
+// hole from the current one has room for the object; objects bigger than a line always go to the
+// end of the old space, so that holes are not given up for them
+static size_t *alloc_in_holes (size_t size) {
+  if (size > LINE_SIZE) { return NULL; }
+  while (hole_cursor + size > hole_limit) {
+    seal_hole();
+    if (holes.next == holes.size) { return NULL; }
+    hole_cursor = holes.holes[holes.next].begin;
+    hole_limit  = holes.holes[holes.next].end;
+    ++holes.next;
+  }
+  size_t *p = hole_cursor;
+  hole_cursor += size;
+  return p;
+}
+
+static void add_hole (size_t *begin, size_t *end) {
+  if (holes.size == holes.capacity) {
+    holes.capacity = MAX(2 * holes.capacity, HOLES_INIT_CAPACITY);
+    holes.holes    = realloc(holes.holes, holes.capacity * sizeof(hole));
+    if (holes.holes == NULL) {
+      perror("ERROR: add_hole: realloc failed\n");
+      exit(1);
+    }
+  }
+  holes.holes[holes.size++] = (hole) {.begin = begin, .end = end};
+}
+
+// blocks which were sparse at the previous collection; empty ones are not evacuated, since they
+// have been filled by allocation since then
+static inline bool is_sparse_block (size_t block) {
+  return block < blocks_number && block_live[block] != 0
+         && block_live[block] * 100 < BLOCK_SIZE * EVACUATION_THRESHOLD_PERCENT;
+}
+
+// words of the nursery not moved yet by the current mark-region collection, the room for them is
+// never taken by objects of sparse blocks
+static size_t young_words_left;
+
+// updates the slot if its object has been moved already, otherwise marks the object. Young objects
+// and objects of sparse blocks are moved to the end of the old space first if there is room
+static void mark_region_visit (size_t **slot) {
+  size_t *obj = *slot;
+  if (!is_valid_heap_pointer(obj)) { return; }
+  bool young = is_young(obj);
+  if ((young || is_old(obj)) && get_forward_address(obj) != 0) {
+    *slot = (size_t *)get_forward_address(obj);
+    return;
+  }
+  if (is_marked(obj)) { return; }
+  size_t *header_ptr = (size_t *)TO_DATA(obj);
+  if (young || (is_old(obj) && is_sparse_block((header_ptr - heap.begin) / BLOCK_SIZE))) {
+    size_t size = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+    if (young) { young_words_left -= size; }
+    if (heap.current + size + young_words_left <= heap.end) {
+      size_t *to = heap.current;
+      heap.current += size;
+      memcpy(to, header_ptr, WORDS_TO_BYTES(size));
+      void *new_content = get_object_content_ptr(to);
+      set_forward_address(obj, (size_t)new_content);
+      obj = *slot = new_content;
+    }
+  }
+  mark_object(obj);
+  if (!is_leaf(obj)) { mark_stack_push(&mark_workers[0].private_stack, obj); }
+}
+
+// the old space gets room for all young survivors and for live objects of sparse blocks, the
+// latter stay in place if there is not enough memory
+void mark_region_trace (void) {
+  size_t room = nursery.current - nursery.begin;
+  for (size_t b = 0; b < blocks_number; ++b) {
+    if (is_sparse_block(b)) { room += block_live[b]; }
+  }
+  size_t needed = (heap.current - heap.begin) + nursery.current - nursery.begin;
+  if (needed > heap.reserved) {
+    fprintf(stderr,
+            "Out of memory: %zu bytes of the old space and of the nursery do not fit into the heap "
+            "limit of %zu bytes\n",
+            WORDS_TO_BYTES(needed),
+            WORDS_TO_BYTES(heap.reserved));
+    exit(1);
+  }
+  commit_chunk(&heap, MAX(heap.size, MIN(heap.current - heap.begin + room, heap.reserved)));
+  reserve_object_starts(heap.size);
+  reserve_mark_bitmap(&heap_marks, heap.size);
+  young_words_left = nursery.current - nursery.begin;
+
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    mark_region_visit((size_t **)p);
+  }
+  // roots pointing to the stack are visited twice, which is harmless
+  for (int i = 0; i < extra_roots.current_free; ++i) {
+    mark_region_visit((size_t **)extra_roots.roots[i]);
+  }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    mark_region_visit((size_t **)p);
+  }
+#endif
+  mark_stack *st = &mark_workers[0].private_stack;
+  while (st->size != 0) {
+    void *header_ptr = get_obj_header_ptr(st->objs[--st->size]);
+    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
+         !field_is_done_iterator(&ptr_field_it);
+         obj_next_ptr_field_iterator(&ptr_field_it)) {
+      mark_region_visit((size_t **)ptr_field_it.cur_field);
+    }
+  }
+}
+
+// dead runs of the old space become fillers, the ones covering a whole line become holes; a dead
+// run at the end is given back to the bump allocation
+void mark_region_sweep (size_t additional_size) {
+  size_t used = heap.current - heap.begin;
+  blocks_number = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (blocks_number > blocks_capacity) {
+    blocks_capacity = MAX(blocks_number, 2 * blocks_capacity);
+    block_live      = realloc(block_live, blocks_capacity * sizeof(size_t));
+    if (block_live == NULL) {
+      perror("ERROR: mark_region_sweep: realloc failed\n");
+      exit(1);
+    }
+  }
+  size_t live = 0;
+  for (size_t b = 0; b < blocks_number; ++b) {
+    size_t end    = MIN((b + 1) * BLOCK_SIZE / MARK_WORD_BITS, bitmap_words(used));
+    block_live[b] = 0;
+    for (size_t w = b * BLOCK_SIZE / MARK_WORD_BITS; w < end; ++w) {
+      block_live[b] += __builtin_popcount(heap_marks.bits[w]);
+    }
+    live += block_live[b];
+  }
+
+  holes.size    = 0;
+  holes.next    = 0;
+  hole_cursor   = NULL;
+  hole_limit    = NULL;
+  size_t *space = heap.begin;
+  size_t  begin = next_unmarked(&heap_marks, 0, used);
+  while (begin < used) {
+    size_t end = next_marked(&heap_marks, begin, used);
+    if (end == used) {
+      heap.current = space + begin;
+      break;
+    }
+    make_filler(space + begin, end - begin);
+    if ((begin + LINE_SIZE - 1) / LINE_SIZE * LINE_SIZE + LINE_SIZE <= end) {
+      add_hole(space + begin, space + end);
+    }
+    begin = next_unmarked(&heap_marks, end, used);
+  }
+
+  memset(heap_marks.bits, 0, bitmap_words(used) * sizeof(uint32_t));
+  memset(leaf_marks.bits,
+         0,
+         bitmap_words(leaf_space.current - leaf_space.begin) * sizeof(uint32_t));
+  sweep_large_objects();
+  nursery.current = nursery.begin;
+  remembered.size = 0;
+
+  size_t size = next_heap_size(live, additional_size);
+  size        = MAX(size, (size_t)(heap.current - heap.begin) + additional_size + nursery.size);
+  commit_chunk(&heap, MIN(size, heap.reserved));
+  reserve_object_starts(heap.size);
+  reserve_mark_bitmap(&heap_marks, heap.size);
 }
 
 inline bool is_valid_heap_pointer (const size_t *p) {
-  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
+  return (!UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current)
+         || is_leaf(p) || is_young(p) || is_large(p);
 }
 
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
 
-static inline void queue_enqueue (heap_iterator *tail_iter, void *obj) {
-  void *tail         = tail_iter->current;
-  void *tail_content = get_object_content_ptr(tail);
-  set_forward_address(tail_content, (size_t)obj);
-  make_enqueued(obj);
-  heap_next_obj_iterator(tail_iter);
+static void mark_stack_reserve (mark_stack *st, size_t size) {
+  if (size <= st->capacity) { return; }
+  st->capacity = MAX(MAX(2 * st->capacity, size), MARK_STACK_INIT_CAPACITY);
+  st->objs     = realloc(st->objs, st->capacity * sizeof(void *));
+  if (st->objs == NULL) {
+    perror("ERROR: mark_stack_reserve: realloc failed\n");
+    exit(1);
+  }
+}
+
+static inline void mark_stack_push (mark_stack *st, void *obj) {
+  if (st->size == st->capacity) { mark_stack_reserve(st, st->size + 1); }
+  st->objs[st->size++] = obj;
 }
 
-static inline void *queue_dequeue (heap_iterator *head_iter) {
-  void *head         = head_iter->current;
-  void *head_content = get_object_content_ptr(head);
-  void *value        = (void *)get_forward_address(head_content);
-  make_dequeued(value);
-  heap_next_obj_iterator(head_iter);
-  return value;
+// moves count objects from the bottom of 'from' (they are closer to roots, so there is more work
+// behind them) to the top of 'to'; sizes of shared stacks are read by other threads without the lock
+static void mark_stack_move (mark_stack *from, mark_stack *to, size_t count) {
+  mark_stack_reserve(to, to->size + count);
+  memcpy(to->objs + to->size, from->objs, count * sizeof(void *));
+  memmove(from->objs, from->objs + count, (from->size - count) * sizeof(void *));
+  __atomic_store_n(&to->size, to->size + count, __ATOMIC_RELAXED);
+  __atomic_store_n(&from->size, from->size - count, __ATOMIC_RELAXED);
+}
+
+static void mark_stack_free (mark_stack *st) {
+  free(st->objs);
+  st->objs     = NULL;
+  st->size     = 0;
+  st->capacity = 0;
 }
 
 void mark (void *obj) {
   if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
-
-  // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
-  // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
-  // iterator where we will write address of the element that is going to be enqueued
-  heap_iterator q_tail_iter = q_head_iter;
-  queue_enqueue(&q_tail_iter, obj);
-
-  // invariant: queue contains only objects that are valid heap pointers (each corresponding to content of unmarked
-  // object) also each object is in queue only once
-  while (q_head_iter.current != q_tail_iter.current) {
-    // while the queue is non-empty
-    void *cur_obj = queue_dequeue(&q_head_iter);
-    mark_object(cur_obj);
-    void *header_ptr = get_obj_header_ptr(cur_obj);
+  // objects are marked when pushed, so each of them is pushed only once; objects of the leaf space
+  // have nothing to scan
+  mark_stack *st = &mark_workers[0].private_stack;
+  mark_object(obj);
+  if (is_leaf(obj)) { return; }
+  mark_stack_push(st, obj);
+  while (st->size != 0) {
+    void *header_ptr = get_obj_header_ptr(st->objs[--st->size]);
     for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
       void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
-        continue;
+      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)) { continue; }
+      mark_object(field_value);
+      if (!is_leaf(field_value)) { mark_stack_push(st, field_value); }
+    }
+  }
+}
+
+static inline void spin_lock (int *lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) { sched_yield(); }
+}
+
+static inline void spin_unlock (int *lock) { __atomic_store_n(lock, 0, __ATOMIC_RELEASE); }
+
+// marks an object, returns false if it was already marked (possibly by another thread)
+static inline bool try_mark_object (void *obj) {
+  size_t       idx;
+  mark_bitmap *bm = object_bitmap(obj, &idx);
+  if (bm == NULL) {
+    large_object *large = to_large_object(obj);
+    return !__atomic_load_n(&large->marked, __ATOMIC_RELAXED)
+           && __atomic_exchange_n(&large->marked, 1, __ATOMIC_RELAXED) == 0;
+  }
+  uint32_t *word = &bm->bits[idx / MARK_WORD_BITS];
+  uint32_t  bit  = 1u << (idx % MARK_WORD_BITS);
+  // the bit of the header decides which thread marks the object
+  if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+      || (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)) {
+    return false;
+  }
+  atomic_set_mark_bits(bm->bits, idx + 1, BYTES_TO_WORDS(obj_size_row_ptr(obj)) - 1);
+  return true;
+}
+
+static inline void mark_worker_visit (mark_worker *self, void *obj) {
+  if (is_valid_heap_pointer(obj) && try_mark_object(obj) && !is_leaf(obj)) {
+    mark_stack_push(&self->private_stack, obj);
+  }
+}
+
+// gives half of the private work away if there is nothing to steal from this worker
+static void mark_worker_share (mark_worker *self) {
+  if (self->private_stack.size < 2
+      || __atomic_load_n(&self->shared_stack.size, __ATOMIC_RELAXED) != 0) {
+    return;
+  }
+  spin_lock(&self->lock);
+  mark_stack_move(&self->private_stack, &self->shared_stack, self->private_stack.size / 2);
+  spin_unlock(&self->lock);
+}
+
+// takes back own shared work or steals half of the shared work of another worker
+static bool mark_worker_take (mark_worker *self) {
+  size_t self_idx = self - mark_workers;
+  for (int i = 0; i < mark_workers_number; ++i) {
+    mark_worker *victim = &mark_workers[(self_idx + i) % mark_workers_number];
+    if (__atomic_load_n(&victim->shared_stack.size, __ATOMIC_RELAXED) == 0) { continue; }
+    spin_lock(&victim->lock);
+    size_t size = victim->shared_stack.size;
+    mark_stack_move(&victim->shared_stack, &self->private_stack, victim == self ? size : (size + 1) / 2);
+    spin_unlock(&victim->lock);
+    if (size != 0) { return true; }
+  }
+  return false;
+}
+
+// returns false when all workers are idle. An idle worker has no work at all, and only the owner
+// fills its shared stack, so then nothing can be left to steal
+static bool mark_worker_wait (void) {
+  __atomic_add_fetch(&mark_idle_workers, 1, __ATOMIC_ACQ_REL);
+  while (__atomic_load_n(&mark_idle_workers, __ATOMIC_ACQUIRE) != mark_workers_number) {
+    for (int i = 0; i < mark_workers_number; ++i) {
+      if (__atomic_load_n(&mark_workers[i].shared_stack.size, __ATOMIC_RELAXED) != 0) {
+        __atomic_sub_fetch(&mark_idle_workers, 1, __ATOMIC_ACQ_REL);
+        return true;
       }
-      // if we came to this point it must be true that field_value is unmarked and not currently in queue
-      // thus, we maintain the invariant
-      queue_enqueue(&q_tail_iter, field_value);
     }
+    sched_yield();
   }
+  return false;
 }
 
+static void *mark_worker_run (void *arg) {
+  mark_worker *self = arg;
+  do {
+    while (self->private_stack.size != 0) {
+      void *obj        = self->private_stack.objs[--self->private_stack.size];
+      void *header_ptr = get_obj_header_ptr(obj);
+      for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
+           !field_is_done_iterator(&ptr_field_it);
+           obj_next_ptr_field_iterator(&ptr_field_it)) {
+        mark_worker_visit(self, *(void **)ptr_field_it.cur_field);
+      }
+      mark_worker_share(self);
+    }
+  } while (mark_worker_take(self) || mark_worker_wait());
+  return NULL;
+}
+
+void parallel_mark_phase (int threads) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "parallel marking has started: %d threads\n", threads);
+#endif
+  // roots are marked by the calling thread, others steal them
+  mark_worker *self = &mark_workers[0];
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    mark_worker_visit(self, *(void **)p);
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) {
+    mark_worker_visit(self, *extra_roots.roots[i]);
+  }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    mark_worker_visit(self, *(void **)p);
+  }
+#endif
+
+  mark_workers_number = threads;
+  mark_idle_workers   = 0;
+  for (int i = 1; i < threads; ++i) {
+    mark_workers[i].started =
+        pthread_create(&mark_workers[i].thread, NULL, mark_worker_run, &mark_workers[i]) == 0;
+    // a worker which has not started is idle forever
+    if (!mark_workers[i].started) { __atomic_add_fetch(&mark_idle_workers, 1, __ATOMIC_ACQ_REL); }
+  }
+  mark_worker_run(self);
+  for (int i = 1; i < threads; ++i) {
+    if (mark_workers[i].started) { pthread_join(mark_workers[i].thread, NULL); }
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "parallel marking has finished\n");
+#endif
+}
+
+void set_gc_threads (int threads) { gc_threads = MIN(MAX(threads, 1), MAX_GC_THREADS); }
+
+// makes an unmarked object of the old space or a large object grey, an object of the leaf space
+// becomes black at once. Young objects are marked only by the final mark, minor_phase empties the
+// nursery without looking at its mark bits
+static inline void shade (void *obj) {
+  if (is_leaf(obj) && !is_marked(obj)) {
+    mark_object(obj);
+  } else if ((is_old(obj) || is_large(obj)) && !is_marked(obj)) {
+    mark_object(obj);
+    mark_stack_push(&mark_workers[0].private_stack, obj);
+  }
+}
+
+void start_incremental_marking (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "incremental marking has started\n");
+#endif
+  incremental_marking = true;
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    shade(*(void **)p);
+  }
+  for (int i = 0; i < extra_roots.current_free; ++i) { shade(*extra_roots.roots[i]); }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    shade(*(void **)p);
+  }
+#endif
+  // spread the slices over a half of the free space, the rest is for objects allocated meanwhile
+  size_t used   = heap.current - heap.begin;
+  size_t slices = used / slice_budget + 1;
+  slice_period  = MAX((size_t)(heap.end - heap.current) / 2 / slices, 1);
+}
+
+bool incremental_mark_slice (size_t budget) {
+  mark_stack *grey    = &mark_workers[0].private_stack;
+  size_t      scanned = 0;
+  while (grey->size != 0 && scanned < budget) {
+    void *header_ptr = get_obj_header_ptr(grey->objs[--grey->size]);
+    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
+         !field_is_done_iterator(&ptr_field_it);
+         obj_next_ptr_field_iterator(&ptr_field_it)) {
+      shade(*(void **)ptr_field_it.cur_field);
+    }
+    scanned += BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+  }
+  return grey->size == 0;
+}
+
+// the roots, the nursery and objects allocated in the old space during marking are not marked yet,
+// old objects may point into the nursery only through remembered slots
+static void finish_incremental_marking (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "final mark has started\n");
+#endif
+  incremental_marking = false;
+  for (size_t i = 0; i < remembered.size; ++i) {
+    mark_worker_visit(&mark_workers[0], *remembered.slots[i]);
+  }
+  parallel_mark_phase(gc_threads);
+}
+
+// is called from alloc(), starts marking or does one slice of it, so that each slice takes about
+// gc_pause_target; when nothing is left to mark, finishes the collection
+static void incremental_step (size_t size) {
+  allocated_since_slice += size;
+  if (allocated_since_slice < slice_period) { return; }
+  allocated_since_slice = 0;
+  if (!incremental_marking) {
+    slice_period = INCREMENTAL_CHECK_PERIOD;
+    if ((heap.current - heap.begin) * 100 < heap.size * INCREMENTAL_MARK_START_PERCENT) { return; }
+  }
+  unsigned long long start = gc_clock();
+  ++gc_stats.marking_slices;
+  if (!incremental_marking) {
+    start_incremental_marking();
+  } else if (incremental_mark_slice(slice_budget)) {
+    full_collection(0);
+  } else {
+    unsigned long long elapsed = gc_clock() - start;
+    if (elapsed != 0) { mark_rate = (mark_rate + (double)slice_budget / elapsed) / 2; }
+    slice_budget = MAX((size_t)(mark_rate * gc_pause_target), INCREMENTAL_MIN_SLICE);
+  }
+  record_pause(start);
+}
+
+void set_gc_pause_target (size_t microseconds) {
+  gc_pause_target = microseconds * 1000ULL;
+  slice_budget    = MAX((size_t)(mark_rate * gc_pause_target), INCREMENTAL_MIN_SLICE);
+  slice_period    = INCREMENTAL_CHECK_PERIOD;
+  update_inline_allocation();
+}
+
+const gc_statistics *get_gc_statistics (void) { return &gc_stats; }
+
 void scan_extra_roots (void) {
   for (int i = 0; i < extra_roots.current_free; ++i) {
     // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
@@ -547,6 +1904,129 @@ void scan_global_area (void) {
 }
 #endif
 
+// if the slot points to a young object, moves the object to the old space or to the leaf space
+// (once) and updates the slot
+static void evacuate (size_t **slot) {
+  size_t *obj = *slot;
+  if (!is_young(obj)) { return; }
+  // forward address of a young object is set when it is moved, it is the new content
+  size_t forward_address = get_forward_address(obj);
+  if (forward_address != 0) {
+    *slot = (size_t *)forward_address;
+    return;
+  }
+  void   *header_ptr = get_obj_header_ptr(obj);
+  size_t  sz         = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
+  bool    mark_region = compaction == MARK_REGION_COMPACTION;
+  size_t *to          = mark_region ? alloc_in_holes(sz) : NULL;
+  if (to != NULL) {
+    // the object is not in the queue [scan, heap.current) of minor_phase
+    mark_stack_push(&promoted, (size_t *)((char *)to + DATA_HEADER_SZ));
+  } else if (!mark_region && is_leaf_object(header_ptr)
+             && leaf_space.current + sz <= leaf_space.end) {
+    to = leaf_space.current;
+    leaf_space.current += sz;
+  } else {
+    // if the leaf space is full, a leaf object goes here too, the old space has room for all
+    // survivors
+    to = heap.current;
+    record_object_start(heap.current, sz);
+    heap.current += sz;
+  }
+  memcpy(to, header_ptr, WORDS_TO_BYTES(sz));
+  void *new_content = get_object_content_ptr(to);
+  set_forward_address(obj, (size_t)new_content);
+  *slot = new_content;
+  // a promoted object may be the only path to a young one from an already scanned object
+  if (incremental_marking) { shade(new_content); }
+}
+
+void minor_phase (void) {
+  // in the worst case every young object survives
+  if (heap.end - heap.current < nursery.current - nursery.begin) {
+    full_collection(0);
+    return;
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "minor collection has started\n");
+#endif
+  ++gc_stats.minor_collections;
+  count_young_words();
+  // promoted objects are appended to the old space, [scan, heap.current) is the queue of objects
+  // whose fields may still point into the nursery; promoted leaf objects have no fields to scan
+  size_t *scan = heap.current;
+
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    evacuate((size_t **)p);
+  }
+  // roots pointing to the stack are evacuated twice, which is harmless
+  for (int i = 0; i < extra_roots.current_free; ++i) { evacuate((size_t **)extra_roots.roots[i]); }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    evacuate((size_t **)p);
+  }
+#endif
+  for (size_t i = 0; i < remembered.size; ++i) { evacuate(remembered.slots[i]); }
+
+  while (scan < heap.current || promoted.size != 0) {
+    size_t *header_ptr = scan;
+    if (promoted.size != 0) {
+      header_ptr = get_obj_header_ptr(promoted.objs[--promoted.size]);
+    } else {
+      scan += BYTES_TO_WORDS(obj_size_header_ptr(scan));
+    }
+    for (obj_field_iterator field_iter = ptr_field_begin_iterator(header_ptr);
+         !field_is_done_iterator(&field_iter);
+         obj_next_ptr_field_iterator(&field_iter)) {
+      evacuate((size_t **)field_iter.cur_field);
+    }
+  }
+
+  nursery.current = nursery.begin;
+  remembered.size = 0;
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "minor collection has finished\n");
+#endif
+}
+
+static inline bool is_old_slot (const void *p) {
+  if ((size_t)heap.begin <= (size_t)p && (size_t)p < (size_t)heap.current) { return true; }
+  return !((size_t)nursery.begin <= (size_t)p && (size_t)p < (size_t)nursery.end)
+         && large_object_of(p) != NULL;
+}
+
+static void remember (size_t **slot) {
+  if (remembered.size == remembered.capacity) {
+    remembered.capacity = MAX(2 * remembered.capacity, REMEMBERED_SET_INIT_CAPACITY);
+    remembered.slots    = realloc(remembered.slots, remembered.capacity * sizeof(size_t **));
+    if (remembered.slots == NULL) {
+      perror("ERROR: remember: realloc failed\n");
+      exit(1);
+    }
+  }
+  remembered.slots[remembered.size++] = slot;
+}
+
+// slots of young objects and roots are scanned by the minor collection anyway, the same slot may
+// be remembered several times
+void gc_write_barrier (void *slot, void *value) {
+  if (is_young(value)) {
+    if (is_old_slot(slot)) { remember(slot); }
+  } else if (incremental_marking) {
+    shade(value);
+  }
+}
+
+void gc_write_barrier_obj (void *obj) {
+  if (!is_old_slot(obj)) { return; }
+  void *header_ptr = get_obj_header_ptr(obj);
+  for (obj_field_iterator field_iter = ptr_field_begin_iterator(header_ptr);
+       !field_is_done_iterator(&field_iter);
+       obj_next_ptr_field_iterator(&field_iter)) {
+    gc_write_barrier(field_iter.cur_field, *(void **)field_iter.cur_field);
+  }
+}
+
 extern void gc_test_and_mark_root (size_t **root) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr,
@@ -564,35 +2044,234 @@ void __gc_init (void) {
   __init();
 }
 
+// reads a size in bytes with an optional K, M or G suffix from the environment variable,
+// returns it in words or dflt if the variable is not set
+static size_t env_size_words (const char *name, size_t dflt) {
+  const char *str = getenv(name);
+  if (str == NULL || *str == '\0') { return dflt; }
+  char  *end;
+  size_t bytes = strtoul(str, &end, 10);
+  switch (*end) {
+    case 'G':
+    case 'g': bytes <<= 10;   // fall through
+    case 'M':
+    case 'm': bytes <<= 10;   // fall through
+    case 'K':
+    case 'k': bytes <<= 10;   // fall through
+    case '\0': break;
+    default: fprintf(stderr, "ERROR: %s: invalid size '%s'\n", name, str); exit(1);
+  }
+  return bytes / sizeof(size_t);
+}
+
+void set_nursery_size (size_t size) {
+  if (nursery.begin != NULL) { munmap(nursery.begin, WORDS_TO_BYTES(nursery.size)); }
+  nursery.begin = NULL;
+  if (size != 0) {
+    nursery.begin = mmap(NULL,
+                         WORDS_TO_BYTES(size),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                         -1,
+                         0);
+    if (nursery.begin == MAP_FAILED) {
+      perror("ERROR: set_nursery_size: mmap failed\n");
+      exit(1);
+    }
+  }
+  nursery.end     = nursery.begin + size;
+  nursery.size    = size;
+  nursery.current = nursery.begin;
+  remembered.size = 0;
+  free_mark_bitmap(&nursery_marks);
+  reserve_mark_bitmap(&nursery_marks, size);
+  free(young_forwards);
+  young_forwards = NULL;
+  if (size != 0) {
+    young_forwards = calloc(size, sizeof(size_t));
+    if (young_forwards == NULL) {
+      perror("ERROR: set_nursery_size: calloc failed\n");
+      exit(1);
+    }
+  }
+  update_inline_allocation();
+}
+
+// reserves address space for a chunk of up to max_size words without allocating memory, a smaller
+// range (but not smaller than min_size) is reserved if the address space is too fragmented
+static void reserve_chunk (memory_chunk *chunk, size_t max_size, size_t min_size) {
+  for (size_t size = max_size;; size /= 2) {
+    chunk->begin = mmap(NULL,
+                        WORDS_TO_BYTES(size),
+                        PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT,
+                        -1,
+                        0);
+    if (chunk->begin != MAP_FAILED) {
+      chunk->reserved = size;
+      break;
+    }
+    if (size <= min_size) {
+      perror("ERROR: reserve_chunk: mmap failed\n");
+      exit(1);
+    }
+  }
+  chunk->current   = chunk->begin;
+  chunk->committed = 0;
+#ifdef MADV_HUGEPAGE
+  // transparent huge pages are used for the heap only if asked, they may waste memory
+  if (getenv("LAMA_GC_HUGE_PAGES") != NULL) {
+    madvise(chunk->begin, WORDS_TO_BYTES(chunk->reserved), MADV_HUGEPAGE);
+  }
+#endif
+}
+
+// makes the first size words of the reserved range the chunk, memory is committed or given back as
+// needed
+static void commit_chunk (memory_chunk *chunk, size_t size) {
+  if (size > chunk->reserved) {
+    fprintf(stderr,
+            "ERROR: commit_chunk: %zu words do not fit into the reserved %zu words\n",
+            size,
+            chunk->reserved);
+    exit(1);
+  }
+  size_t bytes = (WORDS_TO_BYTES(size) + HEAP_COMMIT_GRANULE - 1) & ~(HEAP_COMMIT_GRANULE - 1);
+  bytes        = MIN(bytes, WORDS_TO_BYTES(chunk->reserved));
+  if (bytes > chunk->committed) {
+    void *tail = (char *)chunk->begin + chunk->committed;
+    if (mprotect(tail, bytes - chunk->committed, PROT_READ | PROT_WRITE) != 0) {
+      perror("ERROR: commit_chunk: mprotect failed\n");
+      exit(1);
+    }
+    chunk->committed = bytes;
+  } else if (bytes < chunk->committed) {
+    // the tail is given back to the OS and will be committed again when needed
+    void *tail = (char *)chunk->begin + bytes;
+    if (madvise(tail, chunk->committed - bytes, MADV_DONTNEED) != 0
+        || mprotect(tail, chunk->committed - bytes, PROT_NONE) != 0) {
+      perror("ERROR: commit_chunk: decommit failed\n");
+      exit(1);
+    }
+    chunk->committed = bytes;
+  }
+  chunk->end  = chunk->begin + size;
+  chunk->size = size;
+}
+
+static void release_chunk (memory_chunk *chunk) {
+  if (chunk->begin != NULL) { munmap(chunk->begin, WORDS_TO_BYTES(chunk->reserved)); }
+  memset(chunk, 0, sizeof(memory_chunk));
+}
+
+// LAMA_GC_HEAP_INIT and LAMA_GC_HEAP_MAX are sizes of the old space in bytes, LAMA_GC_TIME is the
+// target percentage of time spent in GC
+static void read_heap_sizing_options (void) {
+  heap_max_size     = env_size_words("LAMA_GC_HEAP_MAX", HEAP_RESERVE_SIZE);
+  heap_max_size     = MAX(heap_max_size, MINIMUM_HEAP_CAPACITY);
+  heap_initial_size = env_size_words("LAMA_GC_HEAP_INIT", INITIAL_HEAP_SIZE);
+  heap_initial_size = MIN(heap_initial_size, heap_max_size);
+
+  const char *target = getenv("LAMA_GC_TIME");
+  gc_time_target     = target == NULL ? 0 : MIN(MAX(atof(target), 0.0), 100.0) / 100;
+
+  // measurements of the previous run are not relevant
+  gc_cost_per_word       = 0;
+  alloc_rate             = 0;
+  allocated_words        = 0;
+  mutator_start          = 0;
+  pause_at_mutator_start = 0;
+}
+
 void __init (void) {
   signal(SIGSEGV, handler);
-  size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
 
   srandom(time(NULL));
 
-  heap.begin = mmap(
-      NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  if (heap.begin == MAP_FAILED) {
-    perror("ERROR: __init: mmap failed\n");
+  read_heap_sizing_options();
+  reserve_chunk(&heap, heap_max_size, heap_initial_size);
+  heap_max_size = heap.reserved;
+  commit_chunk(&heap, heap_initial_size);
+  reserve_object_starts(heap.size);
+  reserve_mark_bitmap(&heap_marks, heap.size);
+  reserve_chunk(&leaf_space, LEAF_SPACE_RESERVE_SIZE, heap_initial_size);
+  commit_chunk(&leaf_space, MIN(heap_initial_size, leaf_space.reserved));
+  reserve_mark_bitmap(&leaf_marks, leaf_space.size);
+  set_nursery_size(env_size_words("LAMA_GC_NURSERY", NURSERY_SIZE));
+  const char *threads = getenv("LAMA_GC_THREADS");
+  if (threads != NULL) { set_gc_threads(atoi(threads)); }
+  const char *pause = getenv("LAMA_GC_PAUSE");
+  if (pause != NULL) { set_gc_pause_target(atoi(pause)); }
+  const char *order = getenv("LAMA_GC_COMPACTION");
+  if (order == NULL || strcmp(order, "sliding") == 0) {
+    set_compaction_mode(SLIDING_COMPACTION);
+  } else if (strcmp(order, "single-pass") == 0) {
+    set_compaction_mode(SINGLE_PASS_COMPACTION);
+  } else if (strcmp(order, "dfs") == 0) {
+    set_compaction_mode(DEPTH_FIRST_COMPACTION);
+  } else if (strcmp(order, "mark-region") == 0) {
+    set_compaction_mode(MARK_REGION_COMPACTION);
+  } else {
+    fprintf(stderr, "ERROR: LAMA_GC_COMPACTION: unknown mode '%s'\n", order);
     exit(1);
   }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
-  heap.current = heap.begin;
   clear_extra_roots();
 }
 
 extern void __shutdown (void) {
-  munmap(heap.begin, heap.size);
+  if (getenv("LAMA_GC_STATS") != NULL) {
+    fprintf(stderr,
+            "GC: %zu full and %zu minor collections, %zu marking slices, max pause %.3f ms, "
+            "total %.3f ms\n",
+            gc_stats.full_collections,
+            gc_stats.minor_collections,
+            gc_stats.marking_slices,
+            gc_stats.max_pause / 1e6,
+            gc_stats.total_pause / 1e6);
+  }
+  memset(&gc_stats, 0, sizeof(gc_stats));
+  incremental_marking = false;
+  release_chunk(&heap);
+  release_chunk(&leaf_space);
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
-  heap.begin        = NULL;
-  heap.end          = NULL;
-  heap.size         = 0;
-  heap.current      = NULL;
   __gc_stack_top    = 0;
   __gc_stack_bottom = 0;
+  set_nursery_size(0);
+  free_mark_bitmap(&heap_marks);
+  free_mark_bitmap(&leaf_marks);
+  free_mark_bitmap(&nursery_marks);
+  for (size_t i = 0; i < large_objects.size; ++i) {
+    munmap(large_objects.objs[i], large_objects.objs[i]->size);
+  }
+  free(large_objects.objs);
+  large_objects.objs     = NULL;
+  large_objects.size     = 0;
+  large_objects.capacity = 0;
+  large_allocated        = 0;
+  free(remembered.slots);
+  remembered.slots    = NULL;
+  remembered.capacity = 0;
+  for (int i = 0; i < MAX_GC_THREADS; ++i) {
+    mark_stack_free(&mark_workers[i].private_stack);
+    mark_stack_free(&mark_workers[i].shared_stack);
+  }
+  free(object_starts);
+  object_starts          = NULL;
+  object_starts_capacity = 0;
+  free(regions);
+  regions          = NULL;
+  regions_capacity = 0;
+  mark_stack_free(&promoted);
+  free(holes.holes);
+  holes       = (hole_list) {0};
+  hole_cursor = NULL;
+  hole_limit  = NULL;
+  free(block_live);
+  block_live      = NULL;
+  blocks_number   = 0;
+  blocks_capacity = 0;
 }
 
 void clear_extra_roots (void) { extra_roots.current_free = 0; }
@@ -654,6 +2333,7 @@ void dump_heap () {
       case SEXP:
         fprintf(stderr, "of kind SEXP with tag %s\n", de_hash(TO_SEXP(content_ptr)->tag));
         break;
+      case CONS: fprintf(stderr, "of kind CONS\n"); break;
     }
   }
 }
@@ -672,49 +2352,53 @@ void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr) {
 
 /* Utility functions */
 
+// tags of objects have one of the two low bits set, while addresses of contents are aligned
 size_t get_forward_address (void *obj) {
-  data *d = TO_DATA(obj);
-  return GET_FORWARD_ADDRESS(d->forward_address);
+  size_t header = (size_t)TO_DATA(obj)->data_header;
+  return (header & 3) != 0 ? 0 : header;
 }
 
-void set_forward_address (void *obj, size_t addr) {
-  data *d = TO_DATA(obj);
-  SET_FORWARD_ADDRESS(d->forward_address, addr);
-}
+void set_forward_address (void *obj, size_t addr) { TO_DATA(obj)->data_header = (int)addr; }
 
 bool is_marked (void *obj) {
-  data *d        = TO_DATA(obj);
-  int   mark_bit = GET_MARK_BIT(d->forward_address);
-  return mark_bit;
+  size_t       idx;
+  mark_bitmap *bm = object_bitmap(obj, &idx);
+  if (bm == NULL) { return to_large_object(obj)->marked; }
+  return (bm->bits[idx / MARK_WORD_BITS] >> (idx % MARK_WORD_BITS)) & 1;
 }
 
 void mark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  SET_MARK_BIT(d->forward_address);
+  size_t       idx;
+  mark_bitmap *bm = object_bitmap(obj, &idx);
+  if (bm == NULL) {
+    to_large_object(obj)->marked = 1;
+    return;
+  }
+  set_mark_bits(bm->bits, idx, BYTES_TO_WORDS(obj_size_row_ptr(obj)), true);
 }
 
 void unmark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  RESET_MARK_BIT(d->forward_address);
-}
-
-bool is_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  return IS_ENQUEUED(d->forward_address) != 0;
-}
-
-void make_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_ENQUEUED(d->forward_address);
+  size_t       idx;
+  mark_bitmap *bm = object_bitmap(obj, &idx);
+  if (bm == NULL) {
+    to_large_object(obj)->marked = 0;
+    return;
+  }
+  set_mark_bits(bm->bits, idx, BYTES_TO_WORDS(obj_size_row_ptr(obj)), false);
 }
 
-void make_dequeued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_DEQUEUED(d->forward_address);
+// the old space goes right after the leaf space, and the nursery after the old space; fillers of
+// the mark-region mode are skipped
+static inline size_t *skip_empty_chunks (size_t *p) {
+  if (p == leaf_space.current) { p = heap.begin; }
+  while (heap.begin <= p && p < heap.current && is_filler(p)) { p += LEN(*(int *)p); }
+  if (p == heap.current) { p = nursery.begin; }
+  return p;
 }
 
 heap_iterator heap_begin_iterator () {
-  heap_iterator it = {.current = heap.begin};
+  seal_hole();
+  heap_iterator it = {.current = skip_empty_chunks(leaf_space.begin)};
   return it;
 }
 
@@ -723,10 +2407,10 @@ void heap_next_obj_iterator (heap_iterator *it) {
   size_t obj_size = obj_size_header_ptr(ptr);
   // make sure we take alignment into consideration
   obj_size = BYTES_TO_WORDS(obj_size);
-  it->current += obj_size;
+  it->current = skip_empty_chunks(it->current + obj_size);
 }
 
-bool heap_is_done_iterator (heap_iterator *it) { return it->current >= heap.current; }
+bool heap_is_done_iterator (heap_iterator *it) { return it->current == nursery.current; }
 
 lama_type get_type_row_ptr (void *ptr) {
   data *data_ptr = TO_DATA(ptr);
@@ -740,6 +2424,7 @@ lama_type get_type_header_ptr (void *ptr) {
     case STRING_TAG: return STRING;
     case CLOSURE_TAG: return CLOSURE;
     case SEXP_TAG: return SEXP;
+    case CONS_TAG: return CONS;
     default: {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr, "ERROR: get_type_header_ptr: unknown object header, cur_id=%d", cur_id);
@@ -779,6 +2464,7 @@ size_t obj_size_header_ptr (void *ptr) {
     case STRING: return string_size(len);
     case CLOSURE: return closure_size(len);
     case SEXP: return sexp_size(len);
+    case CONS: return cons_size();
     default: {
 #ifdef DEBUG_VERSION
       fprintf(stderr, "ERROR: obj_size_header_ptr: unknown object header, cur_id=%d", cur_id);
@@ -791,17 +2477,6 @@ size_t obj_size_header_ptr (void *ptr) {
   }
 }
 
-size_t array_size (size_t sz) { return get_header_size(ARRAY) + MEMBER_SIZE * sz; }
-
-size_t string_size (size_t len) {
-  // string should be null terminated
-  return get_header_size(STRING) + len + 1;
-}
-
-size_t closure_size (size_t sz) { return get_header_size(CLOSURE) + MEMBER_SIZE * sz; }
-
-size_t sexp_size (size_t members) { return get_header_size(SEXP) + MEMBER_SIZE * (members + 1); }
-
 obj_field_iterator field_begin_iterator (void *obj) {
   lama_type          type = get_type_header_ptr(obj);
   obj_field_iterator it = {.type = type, .obj_ptr = obj, .cur_field = get_object_content_ptr(obj)};
@@ -858,7 +2533,8 @@ size_t get_header_size (lama_type type) {
     case STRING:
     case CLOSURE:
     case ARRAY:
-    case SEXP: return DATA_HEADER_SZ;
+    case SEXP:
+    case CONS: return DATA_HEADER_SZ;
     default: perror("ERROR: get_header_size: unknown object type\n");
 #ifdef DEBUG_VERSION
       raise(SIGINT);   // only for debug purposes
@@ -868,7 +2544,7 @@ size_t get_header_size (lama_type type) {
 }
 
 void *alloc_string (int len) {
-  data *obj        = alloc(string_size(len));
+  data *obj        = alloc_leaf(string_size(len));
   obj->data_header = STRING_TAG | (len << 3);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "%p, [STRING] tag=%zu\n", obj, TAG(obj->data_header));
@@ -876,7 +2552,6 @@ void *alloc_string (int len) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
   return obj;
 }
 
@@ -889,7 +2564,6 @@ void *alloc_array (int len) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
   return obj;
 }
 
@@ -902,8 +2576,19 @@ void *alloc_sexp (int members) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
-  obj->tag             = 0;
+  obj->tag = 0;
+  return obj;
+}
+
+void *alloc_cons (void) {
+  data *obj        = alloc(cons_size());
+  obj->data_header = CONS_TAG | (2 << 3);
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "%p, CONS tag=%zu\n", obj, TAG(obj->data_header));
+#endif
+#ifdef DEBUG_VERSION
+  obj->id = cur_id;
+#endif
   return obj;
 }
 
@@ -917,6 +2602,5 @@ void *alloc_closure (int captured) {
 #ifdef DEBUG_VERSION
   obj->id = cur_id;
 #endif
-  obj->forward_address = 0;
   return obj;
 }
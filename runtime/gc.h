@@ -11,30 +11,67 @@
 //  - void *gc_alloc (size_t): this function is basically called whenever we are
 // not able to allocate memory on the existing heap via simple bump allocator.
 //  - mark_phase(): this function will tell you everything you need to know
-// about marking. I would also recommend to pay attention to the fact that
-// marking is implemented without usage of any additional memory. Already
-// allocated space is sufficient (for details see 'void mark (void *obj)').
+// about marking. Mark bits are not stored in objects: they are kept in a side
+// bitmap with one bit per heap word (see 'mark_bitmap'), and all words of a live
+// object are marked. So compaction visits only live objects, skipping dead
+// space by whole bitmap words, and new addresses are computed from popcounts.
+// Objects have no forwarding word: collectors which move objects in another
+// order keep new addresses in place of old headers or in a side table.
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
-// functions used in there. It is basically an implementation of LISP2.
+// functions used in there. It is basically an implementation of LISP2. The heap
+// is a range of address space reserved at start, it grows in place by
+// committing more memory, so objects are never moved by the growth itself
+// (LAMA_GC_HUGE_PAGES asks for transparent huge pages for the range).
+//  - size_t next_heap_size (size_t, size_t): the heap sizing policy. With
+// LAMA_GC_TIME (a percentage of time spent in GC) the heap grows or shrinks from
+// the measured cost of full collections and the allocation rate. A mostly empty
+// heap shrinks and gives its memory back to the OS.
+//  - void minor_phase (void): most objects die young, so they are allocated in
+// a separate region, the nursery. When it is full, only objects reachable from
+// roots and from the remembered set are copied into the main heap (the old
+// space) by Cheney's algorithm. Old objects are not traversed, so the cost of a
+// minor collection is proportional to the amount of live young data. The write
+// barrier (gc_write_barrier) has to see every store into a heap object.
+//  - void *alloc_large (size_t): objects of LARGE_OBJECT_SIZE words and bigger
+// get their own mappings. They are marked and updated in place, but never
+// copied; dead ones are unmapped after compaction.
+//  - void *alloc_leaf (size_t): strings have no pointer fields, so they live in
+// a separate leaf space (promoted young strings go there too). Marking sets
+// their bits without pushing them, and references are updated without walking
+// the leaf space; it is only slid down by compaction.
+//  - void parallel_mark_phase (int threads): with LAMA_GC_THREADS > 1 the full
+// collection marks the heap by several threads. Each thread has its own mark
+// stack and shares part of it with others, idle threads steal work.
+//  - size_t dfs_compute_locations (void): with LAMA_GC_COMPACTION=dfs live
+// objects are laid out in the order of a depth-first traversal from roots
+// instead of the allocation order, so cells of a list or nodes of a tree end up
+// next to each other. They are copied into a scratch area and then back.
+//  - void single_pass_compact (memory_chunk *): with LAMA_GC_COMPACTION=single-pass
+// references of a live object are updated right before it is slid down, so
+// after new addresses are computed from the bitmap the heap is walked once.
+// Sizes and pointer fields are taken from a table indexed by the header tag.
+//  - void mark_region_trace (void): with LAMA_GC_COMPACTION=mark-region the old
+// space is not compacted. It is split into blocks of lines; dead runs covering
+// a whole line become holes, and allocation bumps into them before the end of
+// the old space. The traversal moves young objects and objects of blocks which
+// were sparse at the previous collection to the end of the old space and
+// updates references to them as it meets them.
+//  - size_t parallel_compute_locations (int threads): the same LISP2 passes done
+// by several threads. The heap is split into regions of REGION_SIZE words,
+// new addresses are computed from prefix sums of live words of the regions,
+// then regions are updated and slid down independently.
+//  - void start_incremental_marking (void): with a pause target (LAMA_GC_PAUSE,
+// in microseconds) the old space is marked by small slices done from alloc(),
+// so that each of them takes about the target time. The write barrier keeps
+// marked objects from pointing to unmarked ones, and the final mark only
+// rescans roots before the usual compaction.
 
 #ifndef __LAMA_GC__
 #define __LAMA_GC__
 
 #include "runtime_common.h"
 
-#define GET_MARK_BIT(x) (((int)(x)) & 1)
-#define SET_MARK_BIT(x) (x = (((int)(x)) | 1))
-#define IS_ENQUEUED(x) (((int)(x)) & 2)
-#define MAKE_ENQUEUED(x) (x = (((int)(x)) | 2))
-#define MAKE_DEQUEUED(x) (x = (((int)(x)) & (~2)))
-#define RESET_MARK_BIT(x) (x = (((int)(x)) & (~1)))
-// since last 2 bits are used for mark-bit and enqueued-bit and due to correct
-// alignment we can expect that last 2 bits don't influence address (they
-// should always be zero)
-#define GET_FORWARD_ADDRESS(x) (((size_t)(x)) & (~3))
-// take the last two bits as they are and make all others zero
-#define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((int)(addr))))
 // if heap is full after gc shows in how many times it has to be extended
 #define EXTRA_ROOM_HEAP_COEFFICIENT 2
 #ifdef DEBUG_VERSION
@@ -42,11 +79,105 @@
 #else
 #  define MINIMUM_HEAP_CAPACITY (1 << 2)
 #endif
+// in words: the size of the old space at start and the size of the range reserved for it, the
+// heap cannot grow beyond the reserved range; can be overridden by LAMA_GC_HEAP_INIT and
+// LAMA_GC_HEAP_MAX (in bytes)
+#ifdef DEBUG_VERSION
+#  define INITIAL_HEAP_SIZE MINIMUM_HEAP_CAPACITY
+#else
+#  define INITIAL_HEAP_SIZE (1 << 16)
+#endif
+#define HEAP_RESERVE_SIZE (1 << 28)
+// in words: the size of the range reserved for the leaf space, it starts with the size of the old
+// space and grows the same way
+#define LEAF_SPACE_RESERVE_SIZE (1 << 27)
+// the heap shrinks only if it is this many times bigger than needed after a collection
+#define HEAP_SHRINK_RATIO 4
+// memory of the reserved range is committed by chunks of this size in bytes
+#define HEAP_COMMIT_GRANULE (1 << 16)
+
+// nursery size in words, can be overridden by LAMA_GC_NURSERY (in bytes, 0 disables the nursery)
+#ifdef DEBUG_VERSION
+#  define NURSERY_SIZE (0)   // tests enable the nursery explicitly, see set_nursery_size
+#else
+#  define NURSERY_SIZE (1 << 18)
+#endif
+// objects bigger than this part of the nursery are allocated in the old space
+#define NURSERY_MAX_OBJECT_PART 4
+// initial capacity of the remembered set, it grows twice when full
+#define REMEMBERED_SET_INIT_CAPACITY 1024
+// number of threads marking the heap, can be overridden by LAMA_GC_THREADS
+#define GC_THREADS 1
+#define MAX_GC_THREADS 64
+// heaps smaller than this (in words) are marked by a single thread
+#ifdef DEBUG_VERSION
+#  define PARALLEL_MARK_MIN_HEAP (0)
+#else
+#  define PARALLEL_MARK_MIN_HEAP (1 << 16)
+#endif
+// initial capacity of a mark stack, it grows twice when full
+#define MARK_STACK_INIT_CAPACITY 1024
+// heaps smaller than this (in words) are compacted by a single thread
+#define PARALLEL_COMPACT_MIN_HEAP PARALLEL_MARK_MIN_HEAP
+// incremental marking starts when this percentage of the old space is used
+#define INCREMENTAL_MARK_START_PERCENT 50
+// in words: the smallest marking slice and how often the incremental mode checks
+// whether to start marking
+#ifdef DEBUG_VERSION
+#  define INCREMENTAL_MIN_SLICE (16)
+#  define INCREMENTAL_CHECK_PERIOD (64)
+#else
+#  define INCREMENTAL_MIN_SLICE (256)
+#  define INCREMENTAL_CHECK_PERIOD (1 << 12)
+#endif
+// size of a region of the old space in words, regions are compacted in parallel;
+// has to be a multiple of MARK_WORD_BITS
+#ifdef DEBUG_VERSION
+#  define REGION_SIZE (1 << 6)
+#else
+#  define REGION_SIZE (1 << 12)
+#endif
+// number of heap words covered by a word of a mark bitmap
+#define MARK_WORD_BITS 32
+// objects of this size in words and bigger are allocated in the large object space
+#ifdef DEBUG_VERSION
+#  define LARGE_OBJECT_SIZE (1 << 8)
+#else
+#  define LARGE_OBJECT_SIZE (1 << 14)
+#endif
+// initial capacity of the list of large objects, it grows twice when full
+#define LARGE_OBJECTS_INIT_CAPACITY 64
+// mark-region mode: sizes of a line and of a block of the old space in words, both have to be
+// multiples of MARK_WORD_BITS. Free runs covering a whole line are reused by allocation, blocks
+// with few live words are evacuated by the next collection
+#ifdef DEBUG_VERSION
+#  define LINE_SIZE (1 << 5)
+#  define BLOCK_SIZE (1 << 8)
+#else
+#  define LINE_SIZE (1 << 6)
+#  define BLOCK_SIZE (1 << 13)
+#endif
+// a block is evacuated if less than this percentage of its words were live at the previous
+// collection
+#define EVACUATION_THRESHOLD_PERCENT 25
+// initial capacity of the list of holes, it grows twice when full
+#define HOLES_INIT_CAPACITY 256
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-typedef enum { ARRAY, CLOSURE, STRING, SEXP } lama_type;
+typedef enum { ARRAY, CLOSURE, STRING, SEXP, CONS } lama_type;
+
+// how the old space is compacted, can be set by LAMA_GC_COMPACTION ("sliding", "single-pass",
+// "dfs" or "mark-region")
+typedef enum {
+  SLIDING_COMPACTION,       // allocation order, LISP2
+  SINGLE_PASS_COMPACTION,   // allocation order, references are updated while objects are slid
+  DEPTH_FIRST_COMPACTION,   // order of a depth-first traversal from roots
+  MARK_REGION_COMPACTION,   // objects stay in place, only sparse blocks are evacuated
+} compaction_mode;
 
 typedef struct {
   size_t *current;
@@ -64,16 +195,138 @@ typedef struct {
   size_t *end;
   size_t *current;
   size_t  size;
+  size_t  reserved;    // in words, the chunk grows in place up to this size
+  size_t  committed;   // in bytes
 } memory_chunk;
 
+// Mark bits of a memory chunk, a bit per word. offsets[i] is the number of live words before the
+// i-th word of bits, it is filled by compute_locations and gives new addresses of live objects
+typedef struct {
+  uint32_t *bits;
+  size_t   *offsets;
+  size_t    size;   // in words of bits
+} mark_bitmap;
+
+// Header of an object of the large object space, the object follows it in the same mapping
+typedef struct {
+  size_t size;   // of the mapping in bytes
+  int    marked;
+} large_object;
+
+// Large objects sorted by address. They are marked in place and never moved, unmarked ones are
+// unmapped at the end of compact_phase
+typedef struct {
+  large_object **objs;
+  size_t         size;
+  size_t         capacity;
+} large_object_space;
+
+// Free runs [begin, end) of the old space left by the mark-region collection, allocation takes them
+// in the increasing order
+typedef struct {
+  size_t *begin;
+  size_t *end;
+} hole;
+
+typedef struct {
+  hole  *holes;
+  size_t size;
+  size_t capacity;
+  size_t next;   // the first hole not taken by allocation yet
+} hole_list;
+
+// Slots of old objects that may point into the nursery
+typedef struct {
+  size_t ***slots;
+  size_t    size;
+  size_t    capacity;
+} remembered_set;
+
+// Objects which are marked but whose fields are not scanned yet
+typedef struct {
+  void  **objs;
+  size_t  size;
+  size_t  capacity;
+} mark_stack;
+
+// Parallel marking thread. Only the owner works with private_stack, others steal
+// from shared_stack under the lock
+typedef struct {
+  mark_stack private_stack;
+  mark_stack shared_stack;
+  int        lock;
+  bool       started;
+  pthread_t  thread;
+} mark_worker;
+
+// Objects whose headers lie in [begin, end) are processed by one thread during the parallel
+// compaction; regions cover the old space only
+typedef struct {
+  size_t *begin;
+  size_t *end;
+  size_t  live;   // total size of live objects in words
+  size_t  dest;   // new offset of the first live object from the beginning of the heap
+  int     done;   // objects are already moved
+} compaction_region;
+
+// Collected when the program runs, printed at exit if LAMA_GC_STATS is set. Times are in
+// nanoseconds, a pause is a minor or full collection or a marking slice
+typedef struct {
+  size_t             full_collections;
+  size_t             minor_collections;
+  size_t             marking_slices;
+  unsigned long long max_pause;
+  unsigned long long total_pause;
+} gc_statistics;
+
 
 // the only GC-related function that should be exposed, others are useful for tests and internal implementation
 // allocates object of the given size on the heap
 void *alloc(size_t);
-// takes number of words as a parameter
+// takes number of words as a parameter, the memory is not cleared
 void *gc_alloc(size_t);
-// takes number of words as a parameter
+// takes number of words as a parameter, the memory is not cleared
 void *gc_alloc_on_existing_heap(size_t);
+// takes number of words as a parameter, allocates an object in the large object space
+void *alloc_large(size_t);
+// same as alloc, for objects without pointer fields; if they survive the nursery, they are kept in
+// the leaf space
+void *alloc_leaf(size_t);
+
+// Inline allocation: for objects whose header and every field are written by the caller before
+// anything else is allocated. The memory is not cleared, and while there is room in the nursery it
+// is taken by bumping nursery.current without any calls. gc_inline_max_size (in words) is the
+// biggest object taken this way; it is 0 if the nursery is off, with incremental marking (each
+// allocation has to pace it) and in DEBUG_VERSION (each object gets an id)
+extern memory_chunk nursery;
+extern size_t       gc_inline_max_size;
+#ifdef DEBUG_VERSION
+extern size_t cur_id;
+#endif
+// same as alloc, but the memory is not cleared
+void *alloc_uninitialized_slow (size_t size);
+
+// takes number of bytes like alloc, the memory is not cleared
+static inline void *alloc_uninitialized (size_t size) {
+  size_t  words = BYTES_TO_WORDS(size);
+  size_t *p     = nursery.current;
+  if (words <= gc_inline_max_size && p + words <= nursery.end) {
+    nursery.current = p + words;
+    return p;
+  }
+  return alloc_uninitialized_slow(size);
+}
+
+// writes the header of an object of the given tag and length (the same as alloc_* write), returns
+// its content; fields are left for the caller
+static inline void *init_object_header (void *obj, int tag, int len) {
+  data *d        = obj;
+  d->data_header = tag | (len << 3);
+#ifdef DEBUG_VERSION
+  d->id = cur_id;
+#endif
+  return d->contents;
+}
 
 // specific for mark-and-compact_phase gc
 void mark (void *obj);
@@ -84,12 +337,51 @@ void scan_extra_roots (void);
 // marks each valid pointer from global area
 void scan_global_area (void);
 #endif
+// marks the heap by the given number of threads, the result is the same as of mark_phase
+void parallel_mark_phase (int threads);
+// sets the number of threads used by mark_phase
+void set_gc_threads (int threads);
 // takes number of words that are required to be allocated somewhere on the heap
 void compact_phase (size_t additional_size);
 // specific for Lisp-2 algorithm
 size_t compute_locations ();
 void   update_references (memory_chunk *);
 void   physically_relocate (memory_chunk *);
+// parallel versions of the same passes, they have to be called in the same order
+size_t parallel_compute_locations (int threads);
+void   parallel_update_references (memory_chunk *, int threads);
+void   parallel_physically_relocate (memory_chunk *, int threads);
+// depth-first versions of the same passes, they are done by a single thread
+size_t dfs_compute_locations (void);
+void   dfs_update_references (memory_chunk *);
+void   dfs_physically_relocate (memory_chunk *);
+// the last two LISP2 passes fused into one, done by a single thread after compute_locations
+void   single_pass_compact (memory_chunk *);
+// mark and compact stages of the mark-region mode, called by mark_phase and compact_phase
+void   mark_region_trace (void);
+void   mark_region_sweep (size_t additional_size);
+void   set_compaction_mode (compaction_mode mode);
+
+// specific for generational mode
+// copies live objects from the nursery into the old space, the nursery becomes empty;
+// falls back to the full collection if the old space may be too small for the survivors
+void minor_phase (void);
+// has to be called after each store of value into slot which is a field of a heap object
+void gc_write_barrier (void *slot, void *value);
+// same for all fields of an object at once, obj is a pointer to the object content;
+// used after an object is filled right after allocation
+void gc_write_barrier_obj (void *obj);
+// (re)creates an empty nursery of the given size in words, 0 disables it
+void set_nursery_size (size_t size);
+
+// specific for incremental mode
+// shades objects of the old space referenced from roots, marking continues from alloc()
+void start_incremental_marking (void);
+// scans grey objects until budget words are scanned, returns true if no grey objects are left
+bool incremental_mark_slice (size_t budget);
+// target duration of a marking slice in microseconds, 0 turns the incremental mode off
+void set_gc_pause_target (size_t microseconds);
+const gc_statistics *get_gc_statistics (void);
 
 
 // ============================================================================
@@ -165,10 +457,13 @@ void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr);
 // scans it and if it meets a pointer, it should be modified in according to forward address
 void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end);
 
-// takes a pointer to an object content as an argument, returns forwarding address
+// takes a pointer to an object content as an argument, returns forwarding address or 0; it is kept
+// in place of the header of an object moved by minor_phase, by the depth-first layout or by the
+// mark-region traversal
 size_t get_forward_address (void *obj);
 
 // takes a pointer to an object content as an argument, sets forwarding address to value 'addr'
+// (not 0); the header of the object is lost, so its copy has to be made before
 void set_forward_address (void *obj, size_t addr);
 
 // takes a pointer to an object content as an argument, returns whether this object was marked as live
@@ -180,16 +475,8 @@ void mark_object (void *obj);
 // takes a pointer to an object content as an argument, marks the object as dead
 void unmark_object (void *obj);
 
-// takes a pointer to an object content as an argument, returns whether this object was enqueued to the queue (which is used in mark phase)
-bool is_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, marks object as enqueued
-void make_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, unmarks object as enqueued
-void make_dequeued (void *obj);
-
-// returns iterator to an object with the lowest address
+// returns iterator to the first object of the leaf space; objects of the old space and then of the
+// nursery are visited after it, as if they were the tail of the heap
 heap_iterator heap_begin_iterator ();
 void          heap_next_obj_iterator (heap_iterator *it);
 bool          heap_is_done_iterator (heap_iterator *it);
@@ -207,17 +494,28 @@ size_t obj_size_header_ptr (void *ptr);
 // returns total padding size that we need to store given object type
 size_t get_header_size (lama_type type);
 
+// sizes below are inline, so that alloc_uninitialized of an object makes no calls at all; headers
+// of all types are DATA_HEADER_SZ bytes, see get_header_size
+
 // returns number of bytes that are required to allocate array with 'sz' elements (header included)
-size_t array_size (size_t sz);
+static inline size_t array_size (size_t sz) { return DATA_HEADER_SZ + MEMBER_SIZE * sz; }
 
 // returns number of bytes that are required to allocate string of length 'l' (header included)
-size_t string_size (size_t len);
+static inline size_t string_size (size_t len) {
+  // string should be null terminated
+  return DATA_HEADER_SZ + len + 1;
+}
 
 // returns number of bytes that are required to allocate closure with 'sz-1' captured values (header included)
-size_t closure_size (size_t sz);
+static inline size_t closure_size (size_t sz) { return DATA_HEADER_SZ + MEMBER_SIZE * sz; }
 
 // returns number of bytes that are required to allocate s-expression with 'members' fields (header included)
-size_t sexp_size (size_t members);
+static inline size_t sexp_size (size_t members) {
+  return DATA_HEADER_SZ + MEMBER_SIZE * (members + 1);
+}
+
+// returns number of bytes that are required to allocate a cons cell (header included)
+static inline size_t cons_size (void) { return DATA_HEADER_SZ + MEMBER_SIZE * 2; }
 
 // returns an iterator over object fields, obj is ptr to object header
 // (in case of s-exp, it is mandatory that obj ptr is very beginning of the object,
@@ -246,6 +544,8 @@ void *get_end_of_obj (void *header_ptr);
 void *alloc_string (int len);
 void *alloc_array (int len);
 void *alloc_sexp (int members);
+// a cons cell: s-expression "cons" with two fields, the tag is implied by the header
+void *alloc_cons (void);
 void *alloc_closure (int captured);
 
 #endif
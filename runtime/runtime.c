@@ -59,6 +59,25 @@ void Lassert (void *f, char *s, ...) {
 extern void *Bsexp (int n, ...);
 extern int   LtagHash (char *);
 
+// A cons cell is the s-expression "cons" with two fields kept without the tag word (CONS_TAG), the
+// functions below let the rest of the runtime see both forms the same way
+
+// kind of an object as seen by programs, cons cells are s-expressions
+static inline int kind_of (data *d) {
+  int t = TAG(d->data_header);
+  return t == CONS_TAG ? SEXP_TAG : t;
+}
+
+// the tag of an s-expression (without BOX)
+static inline int sexp_tag (void *p) {
+  return TAG(TO_DATA(p)->data_header) == CONS_TAG ? CONS_TAG_HASH : TO_SEXP(p)->tag;
+}
+
+// the fields of an s-expression
+static inline int *sexp_fields (void *p) {
+  return TAG(TO_DATA(p)->data_header) == CONS_TAG ? (int *)p : (int *)p + 1;
+}
+
 void *global_sysargs;
 void *global_stdout;
 void *global_stderr;
@@ -67,7 +86,7 @@ void *global_stderr;
 extern int LkindOf (void *p) {
   if (UNBOXED(p)) return UNBOXED_TAG;
 
-  return TAG(TO_DATA(p)->data_header);
+  return kind_of(TO_DATA(p));
 }
 
 // Compare s-exprs tags
@@ -80,8 +99,8 @@ extern int LcompareTags (void *p, void *q) {
   pd = TO_DATA(p);
   qd = TO_DATA(q);
 
-  if (TAG(pd->data_header) == SEXP_TAG && TAG(qd->data_header) == SEXP_TAG) {
-    return BOX((TO_SEXP(p)->tag) - (TO_SEXP(q)->tag));
+  if (kind_of(pd) == SEXP_TAG && kind_of(qd) == SEXP_TAG) {
+    return BOX(sexp_tag(p) - sexp_tag(q));
   } else {
     failure("not a sexpr in compareTags: %d, %d\n", TAG(pd->data_header), TAG(qd->data_header));
   }
@@ -217,26 +236,33 @@ static char *chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234
 
 extern char *de_hash (int);
 
+// Position of each character in chars plus one, 0 for characters not allowed in tags
+static unsigned char tag_codes[256];
+
+static void init_tag_codes () {
+  for (int pos = 0; chars[pos]; pos++) tag_codes[(unsigned char)chars[pos]] = pos + 1;
+}
+
 extern int LtagHash (char *s) {
-  char *p;
-  int   h = 0, limit = 0;
+  unsigned char *p;
+  int            h = 0, limit = 0;
 
-  p = s;
+  if (tag_codes[(unsigned char)chars[0]] == 0) init_tag_codes();
 
-  while (*p && limit++ <= 4) {
-    char *q   = chars;
-    int   pos = 0;
+  p = (unsigned char *)s;
 
-    for (; *q && *q != *p; q++, pos++)
-      ;
+  while (*p && limit++ <= 4) {
+    int code = tag_codes[*p];
 
-    if (*q) h = (h << 6) | pos;
+    if (code) h = (h << 6) | (code - 1);
     else failure("tagHash: character not found: %c\n", *p);
 
     p++;
   }
 
-  if (strncmp(s, de_hash(h), 5) != 0) { failure("%s <-> %s\n", s, de_hash(h)); }
+  // de_hash loses leading zero digits, so only a tag starting with chars[0]
+  // fails the round trip; the rest have just been checked character by character
+  if (*s == chars[0]) { failure("%s <-> %s\n", s, de_hash(h)); }
 
   return BOX(h);
 }
@@ -325,7 +351,7 @@ static void printValue (void *p) {
 
     a = TO_DATA(p);
 
-    switch (TAG(a->data_header)) {
+    switch (kind_of(a)) {
       case STRING_TAG: printStringBuf("\"%s\"", a->contents); break;
 
       case CLOSURE_TAG: {
@@ -350,28 +376,26 @@ static void printValue (void *p) {
       }
 
       case SEXP_TAG: {
-        sexp *sa  = (sexp *)a;
-        char *tag = de_hash(sa->tag);
+        char *tag = de_hash(sexp_tag(p));
         if (strcmp(tag, "cons") == 0) {
-          sexp *sb = sa;
+          void *b = p;
           printStringBuf("{");
-          while (LEN(sb->data_header)) {
-            printValue((void *)((int *)sb->contents)[0]);
-            int list_next = ((int *)sb->contents)[1];
+          while (LEN(TO_DATA(b)->data_header)) {
+            printValue((void *)sexp_fields(b)[0]);
+            int list_next = sexp_fields(b)[1];
             if (!UNBOXED(list_next)) {
               printStringBuf(", ");
-              sb = TO_SEXP(list_next);
+              b = (void *)list_next;
             } else break;
           }
           printStringBuf("}");
         } else {
           printStringBuf("%s", tag);
-          sexp *sexp_a = (sexp *)a;
           if (LEN(a->data_header)) {
             printStringBuf(" (");
-            for (i = 0; i < LEN(sexp_a->data_header); i++) {
-              printValue((void *)((int *)sexp_a->contents)[i]);
-              if (i != LEN(sexp_a->data_header) - 1) printStringBuf(", ");
+            for (i = 0; i < LEN(a->data_header); i++) {
+              printValue((void *)sexp_fields(p)[i]);
+              if (i != LEN(a->data_header) - 1) printStringBuf(", ");
             }
             printStringBuf(")");
           }
@@ -392,20 +416,20 @@ static void stringcat (void *p) {
   else {
     a = TO_DATA(p);
 
-    switch (TAG(a->data_header)) {
+    switch (kind_of(a)) {
       case STRING_TAG: printStringBuf("%s", a->contents); break;
 
       case SEXP_TAG: {
-        char *tag = de_hash(TO_SEXP(p)->tag);
+        char *tag = de_hash(sexp_tag(p));
 
         if (strcmp(tag, "cons") == 0) {
-          sexp *b = (sexp *)a;
+          void *b = p;
 
-          while (LEN(b->data_header)) {
-            stringcat((void *)((int *)b->contents)[0]);
-            int next_b = ((int *)b->contents)[1];
+          while (LEN(TO_DATA(b)->data_header)) {
+            stringcat((void *)sexp_fields(b)[0]);
+            int next_b = sexp_fields(b)[1];
             if (!UNBOXED(next_b)) {
-              b = TO_SEXP(next_b);
+              b = (void *)next_b;
             } else break;
           }
         } else printStringBuf("*** non-list data_header: %s ***", tag);
@@ -537,9 +561,16 @@ void *Lclone (void *p) {
       res = (void *)obj->contents;
       break;
 
+    case CONS_TAG:
+      obj = (data *)alloc_cons();
+      memcpy(obj, TO_DATA(p), cons_size());
+      res = (void *)obj->contents;
+      break;
+
     default: failure("invalid data_header %d in clone *****\n", t);
   }
   pop_extra_root(&p);
+  gc_write_barrier_obj(res);
 
   POST_GC();
   return res;
@@ -554,8 +585,9 @@ int inner_hash (int depth, unsigned acc, void *p) {
 
   if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
   else if (is_valid_heap_pointer(p)) {
-    data *a = TO_DATA(p);
-    int   t = TAG(a->data_header), l = LEN(a->data_header), i;
+    data  *a      = TO_DATA(p);
+    int    t      = kind_of(a), l = LEN(a->data_header), i;
+    void **fields = (void **)a->contents;
 
     acc = HASH_APPEND(acc, t);
     acc = HASH_APPEND(acc, l);
@@ -580,17 +612,17 @@ int inner_hash (int depth, unsigned acc, void *p) {
       case ARRAY_TAG: i = 0; break;
 
       case SEXP_TAG: {
-        int ta = TO_SEXP(p)->tag;
+        int ta = sexp_tag(p);
         acc    = HASH_APPEND(acc, ta);
-        i      = 1;
-        ++l;
+        fields = (void **)sexp_fields(p);
+        i      = 0;
         break;
       }
 
       default: failure("invalid data_header %d in hash *****\n", t);
     }
 
-    for (; i < l; i++) acc = inner_hash(depth + 1, acc, ((void **)a->contents)[i]);
+    for (; i < l; i++) acc = inner_hash(depth + 1, acc, fields[i]);
 
     return acc;
   } else return HASH_APPEND(acc, p);
@@ -629,11 +661,11 @@ extern int Lcompare (void *p, void *q) {
   else {
     if (is_valid_heap_pointer(p)) {
       if (is_valid_heap_pointer(q)) {
-        data *a = TO_DATA(p), *b = TO_DATA(q);
-        int   ta = TAG(a->data_header), tb = TAG(b->data_header);
-        int   la = LEN(a->data_header), lb = LEN(b->data_header);
-        int   i;
-        int   shift = 0;
+        data  *a = TO_DATA(p), *b = TO_DATA(q);
+        int    ta = kind_of(a), tb = kind_of(b);
+        int    la = LEN(a->data_header), lb = LEN(b->data_header);
+        int    i;
+        void **fa = (void **)a->contents, **fb = (void **)b->contents;
 
         COMPARE_AND_RETURN(ta, tb);
 
@@ -652,11 +684,12 @@ extern int Lcompare (void *p, void *q) {
             break;
 
           case SEXP_TAG: {
-            int tag_a = TO_SEXP(p)->tag, tag_b = TO_SEXP(q)->tag;
+            int tag_a = sexp_tag(p), tag_b = sexp_tag(q);
             COMPARE_AND_RETURN(tag_a, tag_b);
             COMPARE_AND_RETURN(la, lb);
-            i     = 0;
-            shift = 1;
+            i  = 0;
+            fa = (void **)sexp_fields(p);
+            fb = (void **)sexp_fields(q);
             break;
           }
 
@@ -664,7 +697,7 @@ extern int Lcompare (void *p, void *q) {
         }
 
         for (; i < la; i++) {
-          int c = Lcompare(((void **)a->contents)[i + shift], ((void **)b->contents)[i + shift]);
+          int c = Lcompare(fa[i], fb[i]);
           if (c != BOX(0)) return c;
         }
         return BOX(0);
@@ -686,6 +719,7 @@ extern void *Belem (void *p, int i) {
   switch (TAG(a->data_header)) {
     case STRING_TAG: return (void *)BOX(a->contents[i]);
     case SEXP_TAG: return (void *)((int *)a->contents)[i + 1];
+    // cons cells have no tag word
     default: return (void *)((int *)a->contents)[i];
   }
 }
@@ -806,6 +840,8 @@ extern void *Bclosure (int bn, void *entry, ...) {
 
   va_end(args);
 
+  gc_write_barrier_obj(r->contents);
+
   POST_GC();
 
   pop_extra_root((void **)&r);
@@ -833,6 +869,8 @@ extern void *Barray (int bn, ...) {
 
   va_end(args);
 
+  gc_write_barrier_obj(r->contents);
+
   POST_GC();
   return r->contents;
 }
@@ -844,29 +882,36 @@ extern memory_chunk heap;
 extern void *Bsexp (int bn, ...) {
   va_list args;
   int     i;
-  int     ai;
-  size_t *p;
+  int    *fields;
   data   *r;
   int     n = UNBOX(bn);
 
   PRE_GC();
 
-  int fields_cnt   = n - 1;
-  r                = (data *)alloc_sexp(fields_cnt);
-  ((sexp *)r)->tag = 0;
-
+  // the tag goes after the fields
+  int fields_cnt = n - 1;
   va_start(args, bn);
+  for (i = 0; i < fields_cnt; i++) va_arg(args, int);
+  int tag = UNBOX(va_arg(args, int));
+  va_end(args);
 
-  for (i = 1; i < n; i++) {
-    ai                      = va_arg(args, int);
-    p                       = (size_t *)ai;
-    ((int *)r->contents)[i] = ai;
+  if (tag == CONS_TAG_HASH && fields_cnt == 2) {
+    r      = (data *)alloc_cons();
+    fields = (int *)r->contents;
+  } else {
+    r                = (data *)alloc_sexp(fields_cnt);
+    ((sexp *)r)->tag = tag;
+    fields           = (int *)r->contents + 1;
   }
 
-  ((sexp *)r)->tag = UNBOX(va_arg(args, int));
+  va_start(args, bn);
+
+  for (i = 0; i < fields_cnt; i++) fields[i] = va_arg(args, int);
 
   va_end(args);
 
+  gc_write_barrier_obj(r->contents);
+
   POST_GC();
   return (int *)r->contents;
 }
@@ -877,7 +922,7 @@ extern int Btag (void *d, int t, int n) {
   if (UNBOXED(d)) return BOX(0);
   else {
     r = TO_DATA(d);
-    return BOX(TAG(r->data_header) == SEXP_TAG && TO_SEXP(d)->tag == UNBOX(t)
+    return BOX(kind_of(r) == SEXP_TAG && sexp_tag(d) == UNBOX(t)
                && LEN(r->data_header) == UNBOX(n));
   }
 }
@@ -937,7 +982,7 @@ extern int Bstring_tag_patt (void *x) {
 extern int Bsexp_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
 
-  return BOX(TAG(TO_DATA(x)->data_header) == SEXP_TAG);
+  return BOX(kind_of(TO_DATA(x)) == SEXP_TAG);
 }
 
 extern void *Bsta (void *v, int i, void *x) {
@@ -952,14 +997,17 @@ extern void *Bsta (void *v, int i, void *x) {
       }
       case SEXP_TAG: {
         ((int *)x)[UNBOX(i) + 1] = (int)v;
+        gc_write_barrier((int *)x + UNBOX(i) + 1, v);
         break;
       }
       default: {
         ((int *)x)[UNBOX(i)] = (int)v;
+        gc_write_barrier((int *)x + UNBOX(i), v);
       }
     }
   } else {
     *(void **)x = v;
+    gc_write_barrier(x, v);
   }
 
   return v;
@@ -1245,7 +1293,10 @@ extern void set_args (int argc, char *argv[]) {
   p = LmakeArray(BOX(n));
   push_extra_root((void **)&p);
 
-  for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
+  for (i = 0; i < n; i++) {
+    ((int *)p)[i] = (int)Bstring(argv[i]);
+    gc_write_barrier((int *)p + i, (void *)((int *)p)[i]);
+  }
 
   pop_extra_root((void **)&p);
   POST_GC();
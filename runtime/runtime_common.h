@@ -10,6 +10,7 @@
 #define ARRAY_TAG 0x00000003
 #define SEXP_TAG 0x00000005
 #define CLOSURE_TAG 0x00000007
+#define CONS_TAG 0x00000002      // s-expression "cons" with two fields and without the tag word
 #define UNBOXED_TAG 0x00000009   // Not actually a data_header; used to return from LkindOf
 
 #define LEN(x) ((x & 0xFFFFFFF8) >> 3)
@@ -17,10 +18,13 @@
 
 #define SEXP_ONLY_HEADER_SZ (sizeof(int))
 
+// LtagHash ("cons") without BOX, cons cells answer it as their tag
+#define CONS_TAG_HASH 848787
+
 #ifndef DEBUG_VERSION
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(int))
+#  define DATA_HEADER_SZ (sizeof(int))
 #else
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(size_t) + sizeof(int))
+#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(int))
 #endif
 
 #define MEMBER_SIZE sizeof(int)
@@ -48,10 +52,9 @@ typedef struct {
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
-  size_t forward_address;
-  char   contents[0];
+  // there is no forwarding word: a moved object keeps the address of its new content in place of
+  // data_header, which is told apart by the low bits of its tag (see get_forward_address)
+  char contents[0];
 } data;
 
 typedef struct {
@@ -63,11 +66,8 @@ typedef struct {
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
-  size_t forward_address;
-  int    tag;
-  int    contents[0];
+  int tag;
+  int contents[0];
 } sexp;
 
 #endif
@@ -15,6 +15,15 @@ extern void *Bsexp (int n, ...);
 extern void *Barray (int bn, ...);
 extern void *Bstring (void *);
 extern void *Bclosure (int bn, void *entry, ...);
+extern void *LmakeArray (int length);
+extern void *Bsta (void *v, int i, void *x);
+extern int   Btag (void *d, int t, int n);
+extern int   LkindOf (void *p);
+extern int   Lcompare (void *p, void *q);
+extern int   Lhash (void *p);
+extern void *Lhd (void *v);
+extern void *Ltl (void *v);
+extern void *Lstring (void *p);
 
 extern size_t __gc_stack_top, __gc_stack_bottom;
 
@@ -24,6 +33,7 @@ void test_correct_structure_sizes (void) {
   assert((string_size(0) == get_header_size(STRING) + 1));   // +1 is because of  '\0'
   assert((sexp_size(0) == get_header_size(SEXP) + MEMBER_SIZE));
   assert((closure_size(0) == get_header_size(CLOSURE)));
+  assert((cons_size() == get_header_size(CONS) + MEMBER_SIZE * 2));
 
   // just check correctness for some small sizes
   for (int k = 1; k < 20; ++k) {
@@ -61,6 +71,12 @@ void force_gc_cycle (virt_stack *st) {
   __gc_stack_top = 0;
 }
 
+void force_minor_gc_cycle (virt_stack *st) {
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  minor_phase();
+  __gc_stack_top = 0;
+}
+
 void test_simple_string_alloc (void) {
   virt_stack *st = init_test();
 
@@ -193,6 +209,353 @@ void test_small_tree_compaction (void) {
   cleanup_test(st);
 }
 
+// "cons" with two fields is a cons cell without the tag word, but it answers as the s-expression
+void test_cons_cells (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st,
+              call_runtime_function(
+                  vstack_top(st) - 4, Bsexp, 4, BOX(3), BOX(2), BOX(0), LtagHash("cons")));
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4,
+                                    Bsexp,
+                                    4,
+                                    BOX(3),
+                                    BOX(1),
+                                    vstack_kth_from_start(st, 0),
+                                    LtagHash("cons")));
+  force_gc_cycle(st);
+
+  void *list = (void *)vstack_kth_from_start(st, 1);
+  assert((get_type_row_ptr(list) == CONS));
+  assert((obj_size_row_ptr(list) == cons_size()));
+  assert((Btag(list, LtagHash("cons"), BOX(2)) == BOX(1)));
+  assert((Btag(list, LtagHash("cons"), BOX(3)) == BOX(0)));
+  assert((LkindOf(list) == SEXP_TAG));
+  assert((Lhd(list) == (void *)BOX(1)));
+  assert((Lhd(Ltl(list)) == (void *)BOX(2)));
+  char *str = (char *)call_runtime_function(vstack_top(st) - 4, Lstring, 1, list);
+  assert((strcmp(str, "{1, 2}") == 0));
+
+  // the same list with the usual layout of s-expressions
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  sexp *s        = alloc_sexp(2);
+  s->tag         = UNBOX(LtagHash("cons"));
+  s->contents[0] = BOX(2);
+  s->contents[1] = BOX(0);
+  vstack_push(st, (size_t)&s->tag);
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  s              = alloc_sexp(2);
+  s->tag         = UNBOX(LtagHash("cons"));
+  s->contents[0] = BOX(1);
+  s->contents[1] = (int)vstack_kth_from_start(st, 2);
+  __gc_stack_top = 0;
+  list           = (void *)vstack_kth_from_start(st, 1);
+  assert((Lcompare(list, &s->tag) == BOX(0)));
+  assert((Lhash(list) == Lhash(&s->tag)));
+
+  cleanup_test(st);
+}
+
+extern memory_chunk heap, nursery, leaf_space;
+
+void test_minor_collection (void) {
+  virt_stack *st = init_test();
+  set_nursery_size(1024);
+  // full collection makes the old space big enough for a minor one
+  force_gc_cycle(st);
+
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "alive"));
+  assert((heap.current == heap.begin));
+
+  force_minor_gc_cycle(st);
+  assert((nursery.current == nursery.begin));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+  // the survivor is promoted to the leaf space
+  size_t *s = (size_t *)vstack_kth_from_start(st, 0);
+  assert((leaf_space.begin < s && s < leaf_space.current));
+  assert((strcmp((char *)s, "alive") == 0));
+
+  cleanup_test(st);
+}
+
+void test_write_barrier (void) {
+  virt_stack *st = init_test();
+  set_nursery_size(1024);
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(0)));
+  force_gc_cycle(st);
+  size_t *arr = (size_t *)vstack_kth_from_start(st, 0);
+  assert((heap.begin < arr && arr < heap.current));
+
+  // the only reference to a young string is stored into the old array
+  size_t str = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "young");
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, str, BOX(0), arr);
+  force_minor_gc_cycle(st);
+  assert((nursery.current == nursery.begin));
+  assert((arr == (size_t *)vstack_kth_from_start(st, 0)));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 2));
+  size_t *s = (size_t *)arr[0];
+  assert((leaf_space.begin < s && s < leaf_space.current));
+  assert((strcmp((char *)s, "young") == 0));
+
+  cleanup_test(st);
+}
+
+// objects of alloc_uninitialized get ids like others, so the inline path is off in DEBUG_VERSION
+// and the slow one is tested
+void test_uninitialized_allocation (void) {
+  virt_stack *st = init_test();
+  set_nursery_size(1024);
+  assert((gc_inline_max_size == 0));
+  force_gc_cycle(st);
+
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  int *cell      = init_object_header(alloc_uninitialized(cons_size()), CONS_TAG, 2);
+  cell[0]        = BOX(1);
+  cell[1]        = BOX(0);
+  vstack_push(st, (size_t)cell);
+  __gc_stack_top = 0;
+  assert((nursery.begin < (size_t *)cell && (size_t *)cell < nursery.current));
+  assert((get_type_row_ptr(cell) == CONS));
+
+  force_minor_gc_cycle(st);
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+  cell = (int *)vstack_kth_from_start(st, 0);
+  assert((heap.begin < (size_t *)cell && (size_t *)cell < heap.current));
+  assert((cell[0] == BOX(1) && cell[1] == BOX(0)));
+
+  cleanup_test(st);
+}
+
+// a reference stored into an already scanned object must not be lost by the incremental marking
+void test_incremental_write_barrier (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(0)));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "grey"));
+  size_t c = call_runtime_function(
+      vstack_top(st) - 4, Barray, 2, BOX(1), vstack_kth_from_start(st, 1));
+  // now the string is reachable only from the second array
+  vstack_pop(st);
+  vstack_push(st, c);
+  force_gc_cycle(st);
+
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  start_incremental_marking();
+  // roots are scanned from the top of the stack, so the first array is scanned first
+  assert(!incremental_mark_slice(1));
+  size_t *arr = (size_t *)vstack_kth_from_start(st, 0);
+  size_t *str = (size_t *)((size_t *)vstack_kth_from_start(st, 1))[0];
+  assert(!is_marked(str));
+
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, str, BOX(0), arr);
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, BOX(0), BOX(0), vstack_kth_from_start(st, 1));
+  mark_phase();
+  compact_phase(0);
+  __gc_stack_top = 0;
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 3));
+  arr = (size_t *)vstack_kth_from_start(st, 0);
+  assert((strcmp((char *)arr[0], "grey") == 0));
+
+  cleanup_test(st);
+}
+
+// marking writes nothing into the heap, compaction moves only marked objects of a sparse heap
+void test_mark_bitmap (void) {
+  virt_stack *st = init_test();
+
+  const int N = 1000;
+  for (int i = 0; i < N; ++i) {
+    size_t arr = call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(i));
+    if (i % 10 == 0) { vstack_push(st, arr); }
+  }
+  size_t  used = WORDS_TO_BYTES(heap.current - heap.begin);
+  size_t *copy = malloc(used);
+  memcpy(copy, heap.begin, used);
+
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  mark_phase();
+  assert((memcmp(copy, heap.begin, used) == 0));
+  compact_phase(0);
+  __gc_stack_top = 0;
+
+  int ids[N];
+  assert((objects_snapshot(ids, N) == N / 10));
+  for (int i = 0; i < N / 10; ++i) {
+    assert((((size_t *)vstack_kth_from_start(st, i))[0] == BOX(10 * i)));
+    assert((!is_marked((void *)vstack_kth_from_start(st, i))));
+  }
+
+  free(copy);
+  cleanup_test(st);
+}
+
+// a mostly empty heap shrinks back after a collection
+void test_heap_shrinks (void) {
+  virt_stack *st = init_test();
+
+  const int N = 1000;
+  for (int i = 0; i < N; ++i) {
+    vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(i)));
+  }
+  force_gc_cycle(st);
+  size_t grown = heap.size;
+  assert((grown >= (size_t)N * BYTES_TO_WORDS(array_size(1))));
+
+  for (int i = 0; i < N; ++i) { vstack_pop(st); }
+  force_gc_cycle(st);
+  assert((heap.size < grown && heap.size == MAX(INITIAL_HEAP_SIZE, MINIMUM_HEAP_CAPACITY)));
+
+  cleanup_test(st);
+}
+
+// large objects are never moved, but their fields are updated, and dead ones are freed
+void test_large_objects (void) {
+  virt_stack *st = init_test();
+  set_nursery_size(1024);
+  force_gc_cycle(st);
+
+  const size_t N = LARGE_OBJECT_SIZE;
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(N)));
+  size_t *dead = (size_t *)call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(N));
+  size_t *arr  = (size_t *)vstack_kth_from_start(st, 0);
+  assert((arr < heap.begin || arr > heap.end));
+  assert((is_valid_heap_pointer(arr) && is_valid_heap_pointer(dead)));
+
+  // the first promoted string becomes garbage, so the second one is moved by the full collection
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage"));
+  force_minor_gc_cycle(st);
+  size_t str = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "small");
+  // the large array is the only path to the young string
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, str, BOX(N - 1), arr);
+  force_minor_gc_cycle(st);
+  size_t *promoted = (size_t *)arr[N - 1];
+  assert((leaf_space.begin < promoted && promoted < leaf_space.current));
+  vstack_pop(st);
+
+  force_gc_cycle(st);
+  assert(((size_t *)vstack_kth_from_start(st, 0) == arr));
+  assert(((size_t *)arr[N - 1] < promoted));
+  assert((strcmp((char *)arr[N - 1], "small") == 0));
+  assert((!is_valid_heap_pointer(dead)));
+
+  cleanup_test(st);
+}
+
+// strings are kept apart from objects with pointers and are compacted within their own space
+void test_leaf_space (void) {
+  virt_stack *st = init_test();
+
+  const int N = 100;
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(N)));
+  for (int i = 0; i < N; ++i) {
+    size_t str = call_runtime_function(vstack_top(st) - 4, Bstring, 1, i % 2 ? "dead" : "alive");
+    if (i % 2 == 0) {
+      call_runtime_function(vstack_top(st) - 4, Bsta, 3, str, BOX(i), vstack_kth_from_start(st, 0));
+    }
+  }
+  force_gc_cycle(st);
+
+  size_t *arr = (size_t *)vstack_kth_from_start(st, 0);
+  assert((heap.begin < arr && arr < heap.current));
+  assert((heap.current - heap.begin == BYTES_TO_WORDS(array_size(N))));
+  assert((leaf_space.current - leaf_space.begin == N / 2 * BYTES_TO_WORDS(string_size(5))));
+  for (int i = 0; i < N; i += 2) {
+    size_t *s = (size_t *)arr[i];
+    assert((leaf_space.begin < s && s < leaf_space.current));
+    assert((strcmp((char *)s, "alive") == 0));
+  }
+
+  cleanup_test(st);
+}
+
+// cells of a list are laid out one after another, even if the lists were built interleaved
+void test_depth_first_compaction (void) {
+  virt_stack *st = init_test();
+  set_compaction_mode(DEPTH_FIRST_COMPACTION);
+
+  const int N = 100;
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(2)));
+  for (int i = 0; i < N; ++i) {
+    for (int k = 0; k < 2; ++k) {
+      size_t *arr  = (size_t *)vstack_kth_from_start(st, 0);
+      size_t  cell = call_runtime_function(
+          vstack_top(st) - 4, Bsexp, 4, BOX(3), BOX(i), arr[k], LtagHash("cons"));
+      call_runtime_function(vstack_top(st) - 4, Bsta, 3, cell, BOX(k), vstack_kth_from_start(st, 0));
+    }
+  }
+  force_gc_cycle(st);
+
+  size_t *arr = (size_t *)vstack_kth_from_start(st, 0);
+  for (int k = 0; k < 2; ++k) {
+    size_t *cell = (size_t *)arr[k];
+    for (int i = N - 1; i >= 0; --i) {
+      assert((cell[0] == BOX(i)));
+      size_t *next = (size_t *)cell[1];
+      if (i > 0) { assert((next == cell + BYTES_TO_WORDS(cons_size()))); }
+      cell = next;
+    }
+  }
+
+  set_compaction_mode(SLIDING_COMPACTION);
+  cleanup_test(st);
+}
+
+// objects stay in place except the ones of sparse blocks, dead runs are reused by allocation
+void test_mark_region (void) {
+  virt_stack *st = init_test();
+  set_compaction_mode(MARK_REGION_COMPACTION);
+
+  const int N = 200, LONELY = 120;
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(N)));
+  for (int i = 0; i < N; ++i) {
+    size_t a = call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(i));
+    call_runtime_function(vstack_top(st) - 4, Bsta, 3, a, BOX(i), vstack_kth_from_start(st, 0));
+  }
+  size_t *arr = (size_t *)vstack_kth_from_start(st, 0);
+  for (int i = 40; i < N; ++i) {
+    if (i != LONELY) { arr[i] = BOX(0); }
+  }
+  size_t first = arr[0], lonely = arr[LONELY];
+  force_gc_cycle(st);
+
+  arr = (size_t *)vstack_kth_from_start(st, 0);
+  assert((arr[0] == first && arr[LONELY] == lonely));
+  // the dead run at the end is given back to the bump allocation
+  assert((heap.current == (size_t *)TO_DATA(lonely) + BYTES_TO_WORDS(array_size(1))));
+  size_t fresh = call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(0));
+  assert((arr[39] < fresh && fresh < lonely));
+
+  // the block of the lonely object was sparse, so the next collection moves it
+  force_gc_cycle(st);
+  arr = (size_t *)vstack_kth_from_start(st, 0);
+  assert((arr[0] == first && arr[LONELY] != lonely));
+  assert((((size_t *)arr[LONELY])[0] == BOX(LONELY)));
+
+  int    ids[N + 1];
+  size_t alive = objects_snapshot(ids, N + 1);
+  assert((alive == 42));
+
+  set_compaction_mode(SLIDING_COMPACTION);
+  cleanup_test(st);
+}
+
 extern size_t cur_id;
 
 size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
@@ -229,8 +592,14 @@ size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
   return alive;
 }
 
-void run_stress_test_random_obj_forest (int seed) {
+// the nursery and the compaction mode are set after init_test, which resets them; ordered is false
+// for collectors which do not keep the allocation order, then only the number of alive objects is
+// checked
+static void stress_test_random_obj_forest (int seed, size_t nursery_size, compaction_mode mode,
+                                           bool ordered) {
   virt_stack *st = init_test();
+  set_nursery_size(nursery_size);
+  set_compaction_mode(mode);
 
   const int SZ = 100000;
 
@@ -241,8 +610,157 @@ void run_stress_test_random_obj_forest (int seed) {
   assert(alive == expectedAlive);
 
   // check that order is indeed preserved
-  for (int i = 0; i < alive - 1; ++i) { assert((ids[i] < ids[i + 1])); }
+  if (ordered) {
+    for (int i = 0; i < alive - 1; ++i) { assert((ids[i] < ids[i + 1])); }
+  }
+
+  set_compaction_mode(SLIDING_COMPACTION);
+  cleanup_test(st);
+}
+
+void run_stress_test_random_obj_forest (int seed) {
+  stress_test_random_obj_forest(seed, 0, SLIDING_COMPACTION, true);
+}
+
+// parallel marking must give exactly the same set of marked objects as the sequential one
+void test_parallel_mark (int seed) {
+  virt_stack *st = init_test();
+  srand(seed);
+
+  const int SZ = 20000;
+  vstack_push(st, BOX(1));
+  for (int i = 0; i < SZ; ++i) {
+    size_t field[2];
+    for (int t = 0; t < 2; ++t) { field[t] = vstack_kth_from_start(st, rand() % vstack_size(st)); }
+    vstack_push(st,
+                call_runtime_function(
+                    vstack_top(st) - 4, Bsexp, 4, BOX(3), field[0], field[1], LtagHash("test")));
+  }
+  // objects at the top of the stack are reachable only through older ones, if at all
+  for (int i = 0; i < SZ / 2; ++i) { vstack_pop(st); }
+
+  bool   marked[SZ];
+  size_t n;
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+
+  mark_phase();
+  n = 0;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it), ++n) {
+    void *obj = get_object_content_ptr(it.current);
+    marked[n] = is_marked(obj);
+    unmark_object(obj);
+  }
+
+  parallel_mark_phase(4);
+  n = 0;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it), ++n) {
+    assert((marked[n] == is_marked(get_object_content_ptr(it.current))));
+  }
+
+  compact_phase(0);
+  __gc_stack_top = 0;
+  cleanup_test(st);
+}
+
+// ids of objects referenced from the stack and of their fields, -1 stands for a non-pointer
+static void stack_signature (virt_stack *st, int *sig) {
+  for (size_t i = 0; i < vstack_size(st); ++i, sig += 3) {
+    size_t v = vstack_kth_from_start(st, i);
+    sig[0] = sig[1] = sig[2] = -1;
+    if (v & 1) { continue; }
+    sig[0]  = TO_DATA(v)->id;
+    int *fs = sig + 1;
+    for (obj_field_iterator it = ptr_field_begin_iterator(get_obj_header_ptr((void *)v));
+         !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      size_t f = *(size_t *)it.cur_field;
+      *fs++    = f & 1 ? -1 : TO_DATA(f)->id;
+    }
+  }
+}
+
+// compaction by several threads must keep all references between objects and their order
+void test_parallel_compaction (int seed) {
+  virt_stack *st = init_test();
+  set_nursery_size(seed % 2 ? 4096 : 0);
+  set_gc_threads(4);
+
+  generate_random_obj_forest(st, 20000, seed);
+  size_t n = vstack_size(st);
+  int    before[3 * n], after[3 * n];
+  stack_signature(st, before);
+
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  mark_phase();
+  // survivors of minor collections are not in the allocation order, so compare with the heap
+  // order of marked objects
+  int    marked_ids[n], ids[n];
+  size_t alive = 0;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it)) {
+    void *obj = get_object_content_ptr(it.current);
+    if (is_marked(obj)) { marked_ids[alive++] = TO_DATA(obj)->id; }
+  }
+  compact_phase(0);
+  __gc_stack_top = 0;
+
+  stack_signature(st, after);
+  assert((memcmp(before, after, sizeof(before)) == 0));
+  assert((objects_snapshot(ids, n) == alive));
+  assert((memcmp(marked_ids, ids, alive * sizeof(int)) == 0));
+
+  set_gc_threads(1);
+  cleanup_test(st);
+}
+
+void run_stress_test_random_obj_forest_parallel (int seed) {
+  set_gc_threads(4);
+  run_stress_test_random_obj_forest(seed);
+  set_gc_threads(1);
+}
+
+void run_stress_test_random_obj_forest_single_pass (int seed) {
+  stress_test_random_obj_forest(seed, 0, SINGLE_PASS_COMPACTION, true);
+}
+
+// objects are reordered, so only the number of alive objects is checked
+void run_stress_test_random_obj_forest_depth_first (int seed) {
+  stress_test_random_obj_forest(seed, seed % 2 ? 4096 : 0, DEPTH_FIRST_COMPACTION, false);
+}
+
+// objects are not compacted, so only the number of alive objects is checked
+void run_stress_test_random_obj_forest_mark_region (int seed) {
+  stress_test_random_obj_forest(seed, seed % 2 ? 4096 : 0, MARK_REGION_COMPACTION, false);
+}
+
+// minor collections promote objects in the order of traversal, so only the number of alive objects is checked
+void run_stress_test_random_obj_forest_generational (int seed) {
+  stress_test_random_obj_forest(seed, 4096, SLIDING_COMPACTION, false);
+}
+
+// marking slices are done on almost every allocation; marked objects which died during the marking
+// survive the first collection, so the result is checked after the second one
+void run_stress_test_random_obj_forest_incremental (int seed) {
+  virt_stack *st = init_test();
+  set_nursery_size(seed % 2 ? 4096 : 0);
+  set_gc_pause_target(1);
+
+  const int SZ = 100000;
+
+  size_t expectedAlive = generate_random_obj_forest(st, SZ, seed);
+  assert((get_gc_statistics()->marking_slices > 0));
+  force_gc_cycle(st);
+
+  int    ids[SZ];
+  size_t alive = objects_snapshot(ids, SZ);
+  assert(alive == expectedAlive);
+  if (seed % 2 == 0) {
+    for (int i = 0; i < alive - 1; ++i) { assert((ids[i] < ids[i + 1])); }
+  }
 
+  set_gc_pause_target(0);
   cleanup_test(st);
 }
 
@@ -262,12 +780,31 @@ int main (int argc, char **argv) {
   test_garbage_is_reclaimed();
   test_alive_are_not_reclaimed();
   test_small_tree_compaction();
+  test_cons_cells();
+  test_minor_collection();
+  test_write_barrier();
+  test_uninitialized_allocation();
+  for (int s = 0; s < 5; ++s) { test_parallel_mark(s); }
+  for (int s = 0; s < 10; ++s) { test_parallel_compaction(s); }
+  test_incremental_write_barrier();
+  test_mark_bitmap();
+  test_heap_shrinks();
+  test_large_objects();
+  test_leaf_space();
+  test_depth_first_compaction();
+  test_mark_region();
 
   time_t start, end;
   double diff;
   time(&start);
   // stress test
   for (int s = 0; s < 100; ++s) { run_stress_test_random_obj_forest(s); }
+  for (int s = 0; s < 20; ++s) { run_stress_test_random_obj_forest_generational(s); }
+  for (int s = 0; s < 20; ++s) { run_stress_test_random_obj_forest_parallel(s); }
+  for (int s = 0; s < 20; ++s) { run_stress_test_random_obj_forest_incremental(s); }
+  for (int s = 0; s < 20; ++s) { run_stress_test_random_obj_forest_single_pass(s); }
+  for (int s = 0; s < 20; ++s) { run_stress_test_random_obj_forest_depth_first(s); }
+  for (int s = 0; s < 20; ++s) { run_stress_test_random_obj_forest_mark_region(s); }
   time(&end);
   diff = difftime(end, start);
   printf("Stress tests took %.2lf seconds to complete\n", diff);
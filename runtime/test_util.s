@@ -6,6 +6,8 @@
 call_runtime_function:
     pushl %ebp
     movl %esp, %ebp
+    # edi is callee-saved
+    pushl %edi
 
     # store old stack pointer
     movl %esp, %edi
@@ -34,6 +36,7 @@ f_call:
 
     # restore the old stack pointer
     movl %edi, %esp
+    popl %edi
 
     # pop the old frame pointer and return
     popl %ebp            # epilogue
@@ -0,0 +1,334 @@
+/* Транслятор байткода Ламы в C.
+
+   Каждая функция байткода становится функцией C, каждая инструкция ---
+   несколькими строками C, которые работают со стеком stack_data и
+   вызывают функции рантайма. Глубина операндного стека перед каждой
+   инструкцией известна из верификатора, поэтому слоты стека адресуются
+   константными смещениями, а __gc_stack_top обновляется только перед
+   вызовами, которые могут запустить сборку мусора.
+
+   Результат компилируется с -O2 и собирается с runtime.a, которому нужен
+   -pthread (параллельная разметка), см. aot.h и regression/Makefile:
+     lama-aot prog.bc prog.c
+     gcc -m32 -O2 -pthread -I src prog.c runtime/runtime.a -o prog
+
+   В отличие от интерпретатора, хвостовые вызовы остаются обычными вызовами C,
+   поэтому очень глубокая рекурсия переполняет стек stack_data */
+
+#include "bytecode.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+void *__stop_custom_data  = 0;
+void *__start_custom_data = 0;
+
+static FILE     *out = 0;
+static bytefile *bf  = 0;
+
+static bool *targets = 0; /* Инструкции, на которые есть переходы */
+static int  *next    = 0; /* Следующая инструкция той же функции или -1 */
+
+#define EMIT(...) fprintf(out, __VA_ARGS__)
+
+#define OPCODE_NAME_BINOP(name, op) [OPCODE_BINOP_##name] = "BINOP " #op,
+#define OPCODE_NAME_LD(name, addr) [OPCODE_LD_##name] = "LD " #name,
+#define OPCODE_NAME_LDA(name, addr) [OPCODE_LDA_##name] = "LDA " #name,
+#define OPCODE_NAME_ST(name, addr) [OPCODE_ST_##name] = "ST " #name,
+#define OPCODE_NAME(name, code) [OPCODE_##name] = #name,
+static const char *opcode_names[256] = {MACRO_OPCODES(OPCODE_NAME)};
+#undef OPCODE_NAME
+#undef OPCODE_NAME_ST
+#undef OPCODE_NAME_LDA
+#undef OPCODE_NAME_LD
+#undef OPCODE_NAME_BINOP
+
+/* Строковая таблица целиком, строки адресуются смещениями в ней */
+static void emit_string_table () {
+  EMIT("static char strtab[] =\n  \"");
+  for (int i = 0; i < bf->stringtab_size; ++i) {
+    unsigned char c = bf->string_ptr[i];
+    if (c >= ' ' && c < 0x7F && c != '"' && c != '\\' && c != '?') EMIT("%c", c);
+    else EMIT("\\%03o", c);
+    if (c == 0 && i + 1 < bf->stringtab_size) EMIT("\"\n  \"");
+  }
+  EMIT("\";\n\n");
+}
+
+/* Переменная как lvalue в сгенерированном коде */
+static void emit_var (int mem, int i) {
+  switch (mem) {
+    case MEM_G: EMIT("GLOBALS[%d]", i); break;
+    case MEM_L: EMIT("locals[%d]", i); break;
+    case MEM_A: EMIT("args[%d]", -i); break;
+    case MEM_C: EMIT("CLOSED(%d)", i); break;
+  }
+}
+
+static void emit_instr (size_t k) {
+  instr *in = prog.p + k;
+  int    d  = prog.depth[k];
+
+  switch (in->op >> 4) {
+#define EMIT_BINOP(name, op)                                                                       \
+  case BINOP_##name: fputs(#op, out); break;
+    case HI_BINOP:
+      EMIT("  S(%d) = BOX(UNBOX(S(%d)) ", d - 2, d - 2);
+      switch (in->op & 0x0F) { MACRO_BINOPS(EMIT_BINOP) }
+      EMIT(" UNBOX(S(%d)));\n", d - 1);
+      return;
+#undef EMIT_BINOP
+
+    case HI_LD:
+      EMIT("  S(%d) = ", d);
+      emit_var(in->op & 0x0F, in->a.n);
+      EMIT(";\n");
+      return;
+
+    case HI_LDA:
+      EMIT("  S(%d) = ADDR(&", d);
+      emit_var(in->op & 0x0F, in->a.n);
+      EMIT(");\n");
+      return;
+
+    case HI_ST:
+      EMIT("  ");
+      emit_var(in->op & 0x0F, in->a.n);
+      EMIT(" = S(%d);\n", d - 1);
+      if ((in->op & 0x0F) == MEM_C) {
+        EMIT("  gc_write_barrier(&CLOSED(%d), (void *)S(%d));\n", in->a.n, d - 1);
+      }
+      return;
+  }
+
+  switch (in->op) {
+    case OPCODE_CONST: EMIT("  S(%d) = BOX(%d);\n", d, in->a.n); break;
+
+    case OPCODE_STRING:
+      EMIT("  SYNC(%d);\n", d);
+      EMIT("  S(%d) = (size_t)Bstring(strtab + %d);\n", d, (int)(in->a.s - bf->string_ptr));
+      break;
+
+    case OPCODE_SEXP: {
+      int n = in->b.n;
+      EMIT("  SYNC(%d);\n", d);
+      EMIT("  S(%d) = aot_sexp(%d, %d, &S(%d)); /* %s */\n",
+           d - n,
+           UNBOX(in->c.n),
+           n,
+           d - n,
+           in->a.s);
+    } break;
+
+    case OPCODE_STA:
+      /* Верификатор уже определил, адрес переменной под значением или индекс */
+      if (prog.depth[k + 1] == d - 1) {
+        EMIT("  stack_data[UNBOX(S(%d) & ~0x40000000)] = S(%d);\n", d - 2, d - 1);
+        EMIT("  S(%d) = S(%d);\n", d - 2, d - 1);
+      } else {
+        EMIT("  S(%d) = (size_t)Bsta((void *)S(%d), S(%d), (void *)S(%d));\n",
+             d - 3,
+             d - 1,
+             d - 2,
+             d - 3);
+      }
+      break;
+
+    case OPCODE_JMP: EMIT("  goto L%d;\n", (int)(in->a.target - prog.p)); break;
+
+    case OPCODE_END: EMIT("  return S(%d);\n", d - 1); break;
+
+    case OPCODE_DROP:
+    case OPCODE_LINE: break;
+
+    case OPCODE_DUP: EMIT("  S(%d) = S(%d);\n", d, d - 1); break;
+
+    case OPCODE_ELEM:
+      EMIT("  S(%d) = (size_t)Belem((void *)S(%d), S(%d));\n", d - 2, d - 2, d - 1);
+      break;
+
+    case OPCODE_CJMP_Z:
+    case OPCODE_CJMP_NZ:
+      EMIT("  if (UNBOX(S(%d)) %s 0) goto L%d;\n",
+           d - 1,
+           in->op == OPCODE_CJMP_Z ? "==" : "!=",
+           (int)(in->a.target - prog.p));
+      break;
+
+    case OPCODE_CLOSURE: {
+      int n = in->b.n;
+      for (int j = 0; j < n; ++j) {
+        EMIT("  S(%d) = ", d + j);
+        emit_var(in->c.captures[j].mem, in->c.captures[j].i);
+        EMIT(";\n");
+      }
+      EMIT("  SYNC(%d);\n", d + n);
+      EMIT("  S(%d) = aot_closure(%d, %d, &S(%d));\n", d, in->a.n, n, d);
+    } break;
+
+    case OPCODE_CALLC:
+      EMIT("  SYNC(%d);\n", d);
+      EMIT("  S(%d) = call_closure(S(%d));\n", d - in->a.n - 1, d - in->a.n - 1);
+      break;
+
+    case OPCODE_CALL:
+      EMIT("  SYNC(%d);\n", d);
+      EMIT("  S(%d) = f_%d();\n", d - in->b.n, (int)(in->a.target - prog.p));
+      break;
+
+    case OPCODE_TAG:
+      EMIT("  S(%d) = Btag((void *)S(%d), %d, %d); /* %s */\n",
+           d - 1,
+           d - 1,
+           in->c.n,
+           BOX(in->b.n),
+           in->a.s);
+      break;
+
+    case OPCODE_ARRAY:
+      EMIT("  S(%d) = Barray_patt((void *)S(%d), %d);\n", d - 1, d - 1, BOX(in->a.n));
+      break;
+
+    case OPCODE_FAIL:
+      EMIT("  failure(\"%%d:%%d\\n\", %d, %d);\n", in->a.n, in->b.n);
+      EMIT("  __builtin_unreachable();\n");
+      break;
+
+    case OPCODE_PATT_EQ_STRING:
+      EMIT("  S(%d) = Bstring_patt((void *)S(%d), (void *)S(%d));\n", d - 2, d - 2, d - 1);
+      break;
+
+#define EMIT_PATT(name, fn)                                                                        \
+  case OPCODE_##name: EMIT("  S(%d) = " #fn "((void *)S(%d));\n", d - 1, d - 1); break;
+      EMIT_PATT(PATT_TAG_STRING, Bstring_tag_patt)
+      EMIT_PATT(PATT_TAG_ARRAY, Barray_tag_patt)
+      EMIT_PATT(PATT_TAG_SEXP, Bsexp_tag_patt)
+      EMIT_PATT(PATT_TAG_REF, Bboxed_patt)
+      EMIT_PATT(PATT_TAG_VAL, Bunboxed_patt)
+      EMIT_PATT(PATT_TAG_FUN, Bclosure_tag_patt)
+      EMIT_PATT(BUILTIN_LENGTH, Llength)
+#undef EMIT_PATT
+
+    case OPCODE_BUILTIN_READ: EMIT("  S(%d) = Lread();\n", d); break;
+
+    case OPCODE_BUILTIN_WRITE: EMIT("  S(%d) = Lwrite(S(%d));\n", d - 1, d - 1); break;
+
+    case OPCODE_BUILTIN_STRING:
+      EMIT("  SYNC(%d);\n", d);
+      EMIT("  S(%d) = (size_t)Lstring((void *)S(%d));\n", d - 1, d - 1);
+      break;
+
+    case OPCODE_BUILTIN_ARRAY: {
+      int n = in->a.n;
+      EMIT("  SYNC(%d);\n", d);
+      EMIT("  S(%d) = aot_array(%d, &S(%d));\n", d - n, n, d - n);
+    } break;
+
+    default:
+      /* Остальное верификатор не пропускает, кроме STOP */
+      EMIT("  aot_stop();\n");
+      break;
+  }
+}
+
+static void emit_function (size_t k) {
+  instr *begin = prog.p + k;
+  EMIT("/* %#x: %s %d %d */\n",
+       prog.offsets[k],
+       opcode_names[begin->op],
+       begin->a.n,
+       begin->b.n);
+  EMIT("static size_t f_%d (void) {\n", (int)k);
+  EMIT("  AOT_BEGIN(%d, %d, %d);\n", begin->a.n, begin->b.n, begin->c.n);
+  for (int j = next[k]; j >= 0; j = next[j]) {
+    const char *name = opcode_names[prog.p[j].op];
+    if (targets[j]) EMIT("L%d:\n", j);
+    EMIT("  /* %#x: %s */\n", prog.offsets[j], name ? name : "STOP");
+    emit_instr(j);
+  }
+  EMIT("}\n\n");
+}
+
+static void translate () {
+  targets = (bool *)calloc(prog.n, sizeof(bool));
+  next    = (int *)malloc(prog.n * sizeof(int));
+  if (targets == 0 || next == 0) failure("*** FAILURE: unable to allocate memory.\n");
+
+  /* Списки инструкций каждой функции в порядке следования в байткоде */
+  int *last = (int *)malloc(prog.n * sizeof(int));
+  if (last == 0) failure("*** FAILURE: unable to allocate memory.\n");
+  for (size_t k = 0; k < prog.n; ++k) {
+    next[k] = -1;
+    last[k] = k;
+  }
+  for (size_t k = 0; k < prog.n; ++k) {
+    int owner = prog.owner[k];
+    if (owner < 0) continue;
+    next[last[owner]] = k;
+    last[owner]       = k;
+
+    int op = prog.p[k].op;
+    if (op == OPCODE_JMP || op == OPCODE_CJMP_Z || op == OPCODE_CJMP_NZ) {
+      targets[prog.p[k].a.target - prog.p] = true;
+    }
+  }
+  free(last);
+
+  EMIT("/* Translated from bytecode by lama-aot */\n\n");
+  EMIT("#define AOT_GLOBALS %d\n", bf->global_area_size);
+  EMIT("#include \"aot.h\"\n\n");
+  emit_string_table();
+
+  for (size_t k = 0; k < prog.n; ++k) {
+    int op = prog.p[k].op;
+    if (op == OPCODE_BEGIN || op == OPCODE_CBEGIN) EMIT("static size_t f_%d (void);\n", (int)k);
+  }
+  EMIT("\n");
+
+  /* Замыкания хранят смещение точки входа в байткоде, как у интерпретатора.
+     Каждую точку входа перечисляем один раз */
+  bool *entries = (bool *)calloc(prog.n, sizeof(bool));
+  if (entries == 0) failure("*** FAILURE: unable to allocate memory.\n");
+  EMIT("static size_t call_closure (size_t closure) {\n");
+  EMIT("  switch (*(int *)closure) {\n");
+  for (size_t k = 0; k < prog.n; ++k) {
+    if (prog.p[k].op != OPCODE_CLOSURE) continue;
+    int entry = instr_at(prog.p[k].a.n) - prog.p;
+    if (!entries[entry]) EMIT("    case %d: return f_%d();\n", prog.p[k].a.n, entry);
+    entries[entry] = true;
+  }
+  free(entries);
+  EMIT("  }\n");
+  EMIT("  failure(\"Closure entry %%d is not a function\\n\", *(int *)closure);\n");
+  EMIT("  return 0;\n");
+  EMIT("}\n\n");
+
+  for (size_t k = 0; k < prog.n; ++k) {
+    int op = prog.p[k].op;
+    if (op == OPCODE_BEGIN || op == OPCODE_CBEGIN) emit_function(k);
+  }
+
+  EMIT("int main (int argc, char *argv[]) {\n");
+  EMIT("  aot_init(%d);\n", prog.p[0].a.n);
+  EMIT("  f_0();\n");
+  EMIT("  aot_stop();\n");
+  EMIT("}\n");
+}
+
+int main (int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) failure("Usage: %s <file.bc> [<out.c>]\n", argv[0]);
+
+  bf = read_file(argv[1]);
+  decode(bf);
+  verify(bf);
+
+  out = argc == 3 ? fopen(argv[2], "w") : stdout;
+  if (out == 0) failure("%s\n", strerror(errno));
+  translate();
+  if (fclose(out) != 0) failure("%s\n", strerror(errno));
+
+  free(bf);
+  return 0;
+}
@@ -0,0 +1,104 @@
+/* Поддержка кода, который порождает транслятор байткода в C (lama-aot).
+   Подключается только в сгенерированный файл, перед этим
+   в нём должен быть определён AOT_GLOBALS --- число глобальных переменных.
+
+   Значения хранятся на том же стеке stack_data, что и у интерпретатора,
+   и сборщик мусора находит их так же, по __gc_stack_top.
+   В переменных C ссылки на кучу не переживают вызовов, которые могут
+   запустить сборку мусора. Адреса возврата, размеры фреймов и т.п.
+   хранятся на стеке C, так что на stack_data лежат только значения Ламы. */
+
+#ifndef AOT_H
+#define AOT_H
+
+#include "../runtime/gc.h"
+#include "../runtime/runtime.h"
+#include "../runtime/runtime_common.h"
+
+void *__stop_custom_data  = 0;
+void *__start_custom_data = 0;
+
+extern size_t __gc_stack_top, __gc_stack_bottom;
+
+#define STACK_SIZE (512 * 1024) /* 2 МБ стека, как у интерпретатора */
+static size_t stack_data[STACK_SIZE];
+
+/* Глобальные переменные лежат на дне стека */
+#define GLOBALS (stack_data + STACK_SIZE - AOT_GLOBALS)
+
+/* Слот операндного стека на глубине d (0 --- самый нижний).
+   Глубина перед каждой инструкцией известна из верификатора */
+#define S(d) ops[-(d)]
+
+/* Сборщик мусора должен видеть операндный стек до глубины d */
+#define SYNC(d) (__gc_stack_top = (size_t)(ops - (d)))
+
+/* Начало функции. Аргументы уже на стеке, последний --- на вершине,
+   под первым лежит замыкание, если функцию вызвали через CALLC.
+   Локальные переменные и операнды занимают место ниже */
+#define AOT_BEGIN(nargs, nlocals, words)                                                           \
+  size_t *args __attribute__((unused))   = (size_t *)__gc_stack_top + (nargs);                     \
+  size_t *locals __attribute__((unused)) = (size_t *)__gc_stack_top - (nlocals) + 1;               \
+  size_t *ops                            = (size_t *)__gc_stack_top - (nlocals);                   \
+  aot_check_stack(ops, words);                                                                     \
+  for (int i = 0; i < (nlocals); ++i) locals[i] = 0
+
+/* Захваченная переменная. Замыкание читается со стека каждый раз,
+   т.к. сборщик мусора мог его передвинуть */
+#define CLOSED(i) (((size_t *)args[1])[1 + (i)])
+
+/* Адрес переменной для LDA/STA, в том же виде, что у интерпретатора */
+#define ADDR(p) (BOX((p) - stack_data) | 0x40000000)
+
+static inline void aot_check_stack (size_t *ops, int words) {
+  if (ops - words < stack_data) failure("Stack overflow\n");
+}
+
+/* Аналоги Bsexp, Barray и Bclosure, берущие элементы со стека.
+   first --- слот первого элемента, остальные лежат ниже.
+   Как и в интерпретаторе, память не обнуляется (все поля заполняются сразу),
+   а заполненный объект показываем барьеру записи */
+static inline size_t aot_sexp (int tag, int n, size_t *first) {
+  if (tag == CONS_TAG_HASH && n == 2) {
+    /* Ячейка cons без слова тега, см. alloc_cons */
+    int *arr = init_object_header(alloc_uninitialized(cons_size()), CONS_TAG, 2);
+    arr[0]   = first[0];
+    arr[1]   = first[-1];
+    gc_write_barrier_obj(arr);
+    return (size_t)arr;
+  }
+  int *arr = init_object_header(alloc_uninitialized(sexp_size(n)), SEXP_TAG, n);
+  arr[0]   = tag;
+  for (int i = 0; i < n; ++i) arr[1 + i] = first[-i];
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
+}
+
+static inline size_t aot_array (int n, size_t *first) {
+  int *arr = init_object_header(alloc_uninitialized(array_size(n)), ARRAY_TAG, n);
+  for (int i = 0; i < n; ++i) arr[i] = first[-i];
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
+}
+
+static inline size_t aot_closure (int entry, int n, size_t *first) {
+  int *arr = init_object_header(alloc_uninitialized(closure_size(n + 1)), CLOSURE_TAG, n + 1);
+  arr[0]   = entry;
+  for (int i = 0; i < n; ++i) arr[1 + i] = first[-i];
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
+}
+
+/* Стек с глобальными переменными и nargs аргументами главной функции */
+static inline void aot_init (int nargs) {
+  __gc_init();
+  __gc_stack_bottom = (size_t)(stack_data + STACK_SIZE);
+  __gc_stack_top    = (size_t)(GLOBALS - 1 - nargs);
+}
+
+__attribute__((noreturn)) static inline void aot_stop () {
+  __shutdown();
+  exit(0);
+}
+
+#endif
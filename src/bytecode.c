@@ -0,0 +1,521 @@
+/* Загрузка, декодирование и верификация байткода */
+
+#include "bytecode.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Gets a string from a string table by an index */
+char *get_string (bytefile *f, int pos) { return &f->string_ptr[pos]; }
+
+/* Gets a name for a public symbol */
+char *get_public_name (bytefile *f, int i) { return get_string(f, f->public_ptr[i * 2]); }
+
+/* Gets an offset for a publie symbol */
+int get_public_offset (bytefile *f, int i) { return f->public_ptr[i * 2 + 1]; }
+
+/* Reads a binary bytecode file by name and unpacks it */
+bytefile *read_file (char *fname) {
+  FILE     *f = fopen(fname, "rb");
+  long      size;
+  bytefile *file;
+
+  if (f == 0) { failure("%s\n", strerror(errno)); }
+
+  if (fseek(f, 0, SEEK_END) == -1) { failure("%s\n", strerror(errno)); }
+
+  file = (bytefile *)malloc(sizeof(int) * 3 + sizeof(long) + (size = ftell(f)));
+
+  if (file == 0) { failure("*** FAILURE: unable to allocate memory.\n"); }
+
+  rewind(f);
+
+  if (size != fread(&file->stringtab_size, 1, size, f)) { failure("%s\n", strerror(errno)); }
+
+  fclose(f);
+
+  file->size       = size;
+  file->public_ptr = (int *)file->buffer;
+  file->string_ptr = (char *)(file->public_ptr + 2 * file->public_symbols_number);
+  file->code_ptr   = (unsigned char *)&file->string_ptr[file->stringtab_size];
+
+  return file;
+}
+
+slice_uchar           code   = {};
+program               prog   = {};
+static unsigned char *p_code = 0; /* Позиция декодера в байткоде */
+
+static int instr_int () {
+  ASSERT_MSG(p_code + sizeof(int) <= code.p + code.n,
+             "Unexpected end of bytecode when reading integer argument at %p\n",
+             (void *)(p_code - code.p));
+  int res = *(int *)p_code;
+  p_code += sizeof(int);
+  return res;
+}
+
+static unsigned char instr_byte () {
+  ASSERT_MSG(p_code < code.p + code.n,
+             "Unexpected end of bytecode when reading byte at %p\n",
+             (void *)(p_code - code.p));
+  return *p_code++;
+}
+
+static inline char *instr_string (bytefile *bf) {
+  int pos = instr_int();
+  ASSERT_MSG(
+      (size_t)pos < bf->stringtab_size,
+      "Incorrect shift %d for string, string table size is %d when reading string argument at %p\n",
+      pos,
+      bf->stringtab_size,
+      (void *)(p_code - sizeof(int) - code.p));
+  return get_string(bf, pos);
+}
+
+/* Хэш тега считается один раз на строку, сколько бы инструкций её ни использовали */
+static int instr_tag (bytefile *bf, char *tag) {
+  int pos = tag - bf->string_ptr;
+  if (prog.tags[pos] == 0) prog.tags[pos] = LtagHash(tag);
+  return prog.tags[pos];
+}
+
+/* Разбирает байткод в массив инструкций фиксированной ширины.
+   Все операнды читаются и проверяются на выход за границы здесь,
+   один раз, а не при каждом исполнении инструкции */
+void decode (bytefile *bf) {
+#define INT instr_int()
+#define BYTE instr_byte()
+#define STRING instr_string(bf)
+
+  code.p = bf->code_ptr;
+  code.n = (unsigned char *)&bf->stringtab_size + bf->size - bf->code_ptr;
+
+  /* Каждая инструкция занимает хотя бы байт */
+  prog.p       = (instr *)malloc(code.n * sizeof(instr));
+  prog.offsets = (int *)malloc(code.n * sizeof(int));
+  prog.index   = (int *)malloc(code.n * sizeof(int));
+  prog.tags    = (int *)calloc(bf->stringtab_size + 1, sizeof(int));
+  if (prog.p == 0 || prog.offsets == 0 || prog.index == 0 || prog.tags == 0) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  for (size_t i = 0; i < code.n; ++i) prog.index[i] = -1;
+
+  prog.n = 0;
+  p_code = code.p;
+  for (;;) {
+    int    offset = p_code - code.p;
+    instr *in     = prog.p + prog.n;
+    in->op        = BYTE;
+    in->a.n       = 0;
+    in->b.n       = 0;
+    in->c.n       = 0;
+
+    prog.index[offset]     = prog.n;
+    prog.offsets[prog.n++] = offset;
+
+    switch (in->op) {
+#define DECODE_BINOP(name, op) case OPCODE_BINOP_##name:
+      MACRO_BINOPS(DECODE_BINOP)
+#undef DECODE_BINOP
+      case OPCODE_STI:
+      case OPCODE_STA:
+      case OPCODE_END:
+      case OPCODE_RET:
+      case OPCODE_DROP:
+      case OPCODE_DUP:
+      case OPCODE_SWAP:
+      case OPCODE_ELEM:
+      case OPCODE_PATT_EQ_STRING:
+      case OPCODE_PATT_TAG_STRING:
+      case OPCODE_PATT_TAG_ARRAY:
+      case OPCODE_PATT_TAG_SEXP:
+      case OPCODE_PATT_TAG_REF:
+      case OPCODE_PATT_TAG_VAL:
+      case OPCODE_PATT_TAG_FUN:
+      case OPCODE_BUILTIN_READ:
+      case OPCODE_BUILTIN_WRITE:
+      case OPCODE_BUILTIN_LENGTH:
+      case OPCODE_BUILTIN_STRING: break;
+
+#define DECODE_MEM(name, addr)                                                                     \
+  case OPCODE_LD_##name:                                                                           \
+  case OPCODE_LDA_##name:                                                                          \
+  case OPCODE_ST_##name:
+      MACRO_MEMS(DECODE_MEM)
+#undef DECODE_MEM
+      case OPCODE_CONST:
+      case OPCODE_JMP:
+      case OPCODE_CJMP_Z:
+      case OPCODE_CJMP_NZ:
+      case OPCODE_CALLC:
+      case OPCODE_ARRAY:
+      case OPCODE_LINE:
+      case OPCODE_BUILTIN_ARRAY: in->a.n = INT; break;
+
+      case OPCODE_STRING: in->a.s = STRING; break;
+
+      case OPCODE_SEXP:
+      case OPCODE_TAG:
+        in->a.s = STRING;
+        in->b.n = INT;
+        in->c.n = instr_tag(bf, in->a.s);
+        break;
+
+      case OPCODE_BEGIN:
+      case OPCODE_CBEGIN:
+        in->a.n = INT;
+        in->b.n = INT;
+        ASSERT_MSG(
+            in->a.n >= 0, "Negative function argument count at %p\n", (void *)(size_t)offset);
+        ASSERT_MSG(in->b.n >= 0,
+                   "Negative function local variable count at %p\n",
+                   (void *)(size_t)offset);
+        break;
+
+      case OPCODE_CALL:
+      case OPCODE_FAIL:
+        in->a.n = INT;
+        in->b.n = INT;
+        break;
+
+      case OPCODE_CLOSURE: {
+        in->a.n = INT;
+        in->b.n = INT;
+        ASSERT_MSG(
+            in->b.n >= 0, "Negative closure capture count at %p\n", (void *)(size_t)offset);
+        capture *captures = (capture *)malloc(in->b.n * sizeof(capture) + 1);
+        if (captures == 0) { failure("*** FAILURE: unable to allocate memory.\n"); }
+        for (int j = 0; j < in->b.n; ++j) {
+          captures[j].mem = BYTE;
+          captures[j].i   = INT;
+          ASSERT_MSG(captures[j].mem <= MEM_C,
+                     "Incorrect memory type: %d at %p\n",
+                     captures[j].mem,
+                     (void *)(size_t)offset);
+        }
+        in->c.captures = captures;
+      } break;
+
+      default:
+        if ((in->op & 0xF0) >> 4 == HI_STOP) goto decoded;
+        failure("ERROR: invalid opcode %d-%d at %p\n",
+                (in->op & 0xF0) >> 4,
+                in->op & 0x0F,
+                (void *)(size_t)offset);
+    }
+  }
+
+decoded:
+  /* Адреса переходов можно разрешить только когда известны начала всех инструкций */
+  for (size_t k = 0; k < prog.n; ++k) {
+    instr *in = prog.p + k;
+    switch (in->op) {
+      case OPCODE_JMP:
+      case OPCODE_CJMP_Z:
+      case OPCODE_CJMP_NZ:
+      case OPCODE_CALL: in->a.target = instr_at(in->a.n); break;
+      case OPCODE_CLOSURE: (void)instr_at(in->a.n); break;
+    }
+  }
+
+#undef STRING
+#undef BYTE
+#undef INT
+}
+
+/* Абстрактное состояние операндного стека перед инструкцией при верификации:
+   глубина относительно фрейма функции и то, какие из нижних слотов
+   содержат адреса переменных от LDA (от этого зависит поведение STA) */
+typedef struct {
+  int                depth;
+  unsigned long long addrs;
+} vstate;
+
+#define VSTATE_ADDR_SLOTS 64
+#define VSTATE_IS_ADDR(st, pos) ((pos) < VSTATE_ADDR_SLOTS && ((st).addrs >> (pos)) & 1)
+
+/* Служебный объём фрейма: заголовок frame интерпретатора без адреса возврата.
+   Адрес возврата следующего вызова учитывается в глубине стека
+   вызывающей функции */
+#define FRAME_HEADER_WORDS 4
+
+#define VERIFY(cond, fmt, ...)                                                                     \
+  ASSERT_MSG(cond,                                                                                 \
+             "Bytecode verification failed at %p: " fmt "\n",                                      \
+             (void *)(size_t)prog.offsets[k],                                                      \
+             ##__VA_ARGS__)
+
+static vstate *v_states = 0;
+static int    *v_owner  = 0; /* Функция, к которой относится инструкция, или -1 */
+static int    *v_work   = 0;
+static int     v_nwork  = 0;
+
+static void verify_flow (int k, int to, int func, vstate st) {
+  VERIFY(prog.p[to].op != OPCODE_BEGIN && prog.p[to].op != OPCODE_CBEGIN,
+         "control flows into another function");
+  if (v_owner[to] < 0) {
+    v_owner[to]       = func;
+    v_states[to]      = st;
+    v_work[v_nwork++] = to;
+    return;
+  }
+  VERIFY(v_owner[to] == func,
+         "code at %p is shared between functions",
+         (void *)(size_t)prog.offsets[to]);
+  VERIFY(v_states[to].depth == st.depth && v_states[to].addrs == st.addrs,
+         "inconsistent operand stack at %p: depth %d and %d",
+         (void *)(size_t)prog.offsets[to],
+         v_states[to].depth,
+         st.depth);
+}
+
+/* Проверяет одну функцию, начинающуюся с инструкции BEGIN/CBEGIN с номером entry.
+   captured --- наименьшее число захваченных переменных среди замыканий
+   этой функции или -1, если замыканий нет или функция вызывается и через CALL */
+static void verify_function (bytefile *bf, int entry, int captured) {
+  int    k        = entry;
+  instr *begin    = prog.p + entry;
+  int    nargs    = begin->a.n;
+  int    nlocals  = begin->b.n;
+  int    maxdepth = 0;
+
+  vstate st = {0, 0};
+  v_nwork   = 0;
+  verify_flow(k, k + 1, entry, st);
+
+  while (v_nwork > 0) {
+    k          = v_work[--v_nwork];
+    st         = v_states[k];
+    instr *in  = prog.p + k;
+    int    pop = 0, push = 0, extra = 0;
+    bool   falls = true;
+    bool   addr  = false;
+
+    switch (in->op) {
+#define VERIFY_BINOP(name, op) case OPCODE_BINOP_##name:
+      MACRO_BINOPS(VERIFY_BINOP)
+#undef VERIFY_BINOP
+      case OPCODE_ELEM:
+      case OPCODE_PATT_EQ_STRING:
+        pop  = 2;
+        push = 1;
+        break;
+
+      case OPCODE_CONST:
+      case OPCODE_STRING:
+      case OPCODE_BUILTIN_READ: push = 1; break;
+
+      case OPCODE_SEXP:
+      case OPCODE_BUILTIN_ARRAY:
+        pop  = in->op == OPCODE_SEXP ? in->b.n : in->a.n;
+        push = 1;
+        VERIFY(pop >= 0, "negative number of elements");
+        break;
+
+      case OPCODE_STA: {
+        /* Индекс под значением: адрес переменной или индекс в объекте */
+        int pos = st.depth - 2;
+        VERIFY(pos < VSTATE_ADDR_SLOTS || st.depth < 2, "STA operand is too deep to verify");
+        pop  = pos >= 0 && VSTATE_IS_ADDR(st, pos) ? 2 : 3;
+        push = 1;
+        addr = st.depth > 0 && VSTATE_IS_ADDR(st, st.depth - 1);
+      } break;
+
+      case OPCODE_JMP:
+        falls = false;
+        verify_flow(k, in->a.target - prog.p, entry, st);
+        break;
+
+      case OPCODE_END:
+        VERIFY(st.depth >= 1, "function returns with an empty operand stack");
+        falls = false;
+        break;
+
+      case OPCODE_DROP:
+      case OPCODE_CJMP_Z:
+      case OPCODE_CJMP_NZ: pop = 1; break;
+
+      case OPCODE_DUP:
+        pop  = 1;
+        push = 2;
+        addr = st.depth > 0 && VSTATE_IS_ADDR(st, st.depth - 1);
+        break;
+
+      case OPCODE_TAG:
+      case OPCODE_ARRAY:
+      case OPCODE_PATT_TAG_STRING:
+      case OPCODE_PATT_TAG_ARRAY:
+      case OPCODE_PATT_TAG_SEXP:
+      case OPCODE_PATT_TAG_REF:
+      case OPCODE_PATT_TAG_VAL:
+      case OPCODE_PATT_TAG_FUN:
+      case OPCODE_BUILTIN_WRITE:
+      case OPCODE_BUILTIN_LENGTH:
+      case OPCODE_BUILTIN_STRING:
+        pop  = 1;
+        push = 1;
+        break;
+
+      case OPCODE_LINE: break;
+
+#define VERIFY_MEM(name, a)                                                                        \
+  case OPCODE_LD_##name:                                                                           \
+  case OPCODE_LDA_##name:                                                                          \
+  case OPCODE_ST_##name:
+        MACRO_MEMS(VERIFY_MEM)
+#undef VERIFY_MEM
+        {
+          int mem = in->op & 0x0F, i = in->a.n;
+          int n   = mem == MEM_G ? bf->global_area_size
+                  : mem == MEM_L ? nlocals
+                  : mem == MEM_A ? nargs
+                                 : captured;
+          VERIFY(mem != MEM_C || captured >= 0,
+                 "captured variable is accessed in a function that is not a closure");
+          VERIFY(
+              i >= 0 && i < n, "addressing %dth variable of type %d when only %d exist", i, mem, n);
+          if ((in->op & 0xF0) >> 4 == HI_ST) {
+            pop  = 1;
+            push = 1;
+            addr = st.depth > 0 && VSTATE_IS_ADDR(st, st.depth - 1);
+          } else {
+            push = 1;
+            addr = (in->op & 0xF0) >> 4 == HI_LDA;
+            VERIFY(!addr || st.depth < VSTATE_ADDR_SLOTS, "LDA operand is too deep to verify");
+          }
+        }
+        break;
+
+      case OPCODE_CLOSURE:
+        for (int j = 0; j < in->b.n; ++j) {
+          capture c = in->c.captures[j];
+          int     n = c.mem == MEM_G ? bf->global_area_size
+                    : c.mem == MEM_L ? nlocals
+                    : c.mem == MEM_A ? nargs
+                                     : captured;
+          VERIFY(c.mem != MEM_C || captured >= 0,
+                 "captured variable is accessed in a function that is not a closure");
+          VERIFY(c.i >= 0 && c.i < n,
+                 "capturing %dth variable of type %d when only %d exist",
+                 c.i,
+                 c.mem,
+                 n);
+        }
+        /* Интерпретатор кладёт все захваченные значения на стек до Wclosure */
+        push  = 1;
+        extra = in->b.n;
+        break;
+
+      case OPCODE_CALLC:
+        VERIFY(in->a.n >= 0, "negative number of arguments");
+        pop   = in->a.n + 1;
+        push  = 1;
+        extra = 1;
+        break;
+
+      case OPCODE_CALL: {
+        instr *callee = in->a.target;
+        VERIFY(callee->op == OPCODE_BEGIN || callee->op == OPCODE_CBEGIN,
+               "call target %p is not a function",
+               (void *)(size_t)prog.offsets[callee - prog.p]);
+        VERIFY(callee->a.n == in->b.n,
+               "function at %p takes %d arguments, called with %d",
+               (void *)(size_t)prog.offsets[callee - prog.p],
+               callee->a.n,
+               in->b.n);
+        pop   = in->b.n;
+        push  = 1;
+        extra = 1;
+      } break;
+
+      case OPCODE_FAIL: falls = false; break;
+
+      default:
+        if ((in->op & 0xF0) >> 4 == HI_STOP) {
+          falls = false;
+          break;
+        }
+        VERIFY(false, "instruction %d-%d is not supported", (in->op & 0xF0) >> 4, in->op & 0x0F);
+    }
+
+    VERIFY(st.depth >= pop, "operand stack underflow");
+    maxdepth = MAX(maxdepth, MAX(st.depth + extra, st.depth - pop + push));
+    if (falls) {
+      vstate next = {st.depth - pop + push, st.addrs};
+      int    top  = next.depth - 1;
+      if (next.depth < VSTATE_ADDR_SLOTS) next.addrs &= (1ULL << next.depth) - 1;
+      if (push > 0 && top < VSTATE_ADDR_SLOTS) {
+        next.addrs &= ~(1ULL << top);
+        if (addr) next.addrs |= 1ULL << top;
+      }
+      if (in->op == OPCODE_CJMP_Z || in->op == OPCODE_CJMP_NZ) {
+        verify_flow(k, in->a.target - prog.p, entry, next);
+      }
+      verify_flow(k, k + 1, entry, next);
+    }
+  }
+
+  /* Сколько слов нужно функции на стеке, не считая аргументов */
+  begin->c.n = nlocals + FRAME_HEADER_WORDS + maxdepth;
+}
+
+/* Проверяет программу один раз при загрузке: границы переменных,
+   согласованность глубины стека в точках слияния, цели вызовов и
+   максимальную глубину стека каждой функции. После этого интерпретатор
+   обходится без проверок на каждой инструкции */
+void verify (bytefile *bf) {
+  int k;
+
+  /* Наименьшее число захваченных переменных для каждой точки входа замыкания */
+  int *captured = (int *)malloc(prog.n * sizeof(int));
+  /* Функции, вызываемые напрямую, не получают замыкания */
+  bool *called = (bool *)calloc(prog.n, sizeof(bool));
+  v_states      = (vstate *)malloc(prog.n * sizeof(vstate));
+  v_owner       = (int *)malloc(prog.n * sizeof(int));
+  v_work        = (int *)malloc(prog.n * sizeof(int));
+  if (captured == 0 || called == 0 || v_states == 0 || v_owner == 0 || v_work == 0) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  for (k = 0; k < prog.n; ++k) {
+    captured[k] = -1;
+    v_owner[k]  = -1;
+  }
+
+  for (k = 0; k < prog.n; ++k) {
+    instr *in = prog.p + k;
+    if (in->op == OPCODE_CLOSURE) {
+      int entry = instr_at(in->a.n) - prog.p;
+      VERIFY(prog.p[entry].op == OPCODE_BEGIN || prog.p[entry].op == OPCODE_CBEGIN,
+             "closure entry %p is not a function",
+             (void *)(size_t)in->a.n);
+      if (captured[entry] < 0 || in->b.n < captured[entry]) captured[entry] = in->b.n;
+    } else if (in->op == OPCODE_CALL) {
+      called[in->a.target - prog.p] = true;
+    }
+  }
+
+  k = 0;
+  VERIFY(prog.p[0].op == OPCODE_BEGIN || prog.p[0].op == OPCODE_CBEGIN,
+         "program does not start with a function");
+  for (k = 0; k < prog.n; ++k) {
+    instr *in = prog.p + k;
+    if (in->op == OPCODE_BEGIN || in->op == OPCODE_CBEGIN) {
+      verify_function(bf, k, called[k] ? -1 : captured[k]);
+    }
+  }
+
+  prog.owner = v_owner;
+  prog.depth = (int *)malloc(prog.n * sizeof(int));
+  if (prog.depth == 0) failure("*** FAILURE: unable to allocate memory.\n");
+  for (k = 0; k < prog.n; ++k) prog.depth[k] = v_owner[k] < 0 ? -1 : v_states[k].depth;
+
+  free(v_work);
+  free(v_states);
+  free(called);
+  free(captured);
+}
+
+#undef VERIFY
@@ -0,0 +1,255 @@
+/* Загрузка, декодирование и верификация байткода, общие для интерпретатора и транслятора */
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "../runtime/runtime.h"
+#include "../runtime/runtime_common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ASSERT_MSG(cond, ...)                                                                      \
+  do {                                                                                             \
+    if (!(cond)) failure(__VA_ARGS__);                                                             \
+  } while (0)
+
+/* Проверки, которые для проверенного верификатором байткода нужны только при отладке */
+#ifdef NDEBUG
+#  define DEBUG_ASSERT_MSG(cond, ...) ((void)0)
+#else
+#  define DEBUG_ASSERT_MSG(cond, ...) ASSERT_MSG(cond, __VA_ARGS__)
+#endif
+
+/* The unpacked representation of bytecode file */
+typedef struct {
+  char          *string_ptr; /* A pointer to the beginning of the string tablei */
+  int           *public_ptr; /* A pointer to the beginning of publics tablei */
+  unsigned char *code_ptr; /* A pointer to the bytecode itselfi */
+  long           size;
+  int            stringtab_size; /* The size (in bytes) of the string tablei */
+  int            global_area_size; /* The size (in words) of global areai */
+  int            public_symbols_number; /* The number of public symbolsi */
+  unsigned char  buffer[0];
+} bytefile;
+
+/* Gets a string from a string table by an index */
+char *get_string (bytefile *f, int pos);
+
+/* Gets a name for a public symbol */
+char *get_public_name (bytefile *f, int i);
+
+/* Gets an offset for a publie symbol */
+int get_public_offset (bytefile *f, int i);
+
+/* Reads a binary bytecode file by name and unpacks it */
+bytefile *read_file (char *fname);
+
+enum {
+  HI_STOP  = 15,
+  HI_BINOP = 0,
+  HI_1,
+  HI_LD,
+  HI_LDA,
+  HI_ST,
+  HI_2,
+  HI_PATT,
+  HI_BUILTIN,
+};
+
+#define MACRO_BINOPS(E)                                                                            \
+  E(ADD, +)                                                                                        \
+  E(SUB, -)                                                                                        \
+  E(MUL, *)                                                                                        \
+  E(DIV, /)                                                                                        \
+  E(MOD, %)                                                                                        \
+  E(LT, <)                                                                                         \
+  E(LE, <=)                                                                                        \
+  E(GT, >)                                                                                         \
+  E(GE, >=)                                                                                        \
+  E(EQ, ==)                                                                                        \
+  E(NE, !=)                                                                                        \
+  E(AND, &&)                                                                                       \
+  E(OR, ||)
+
+enum {
+  _BINOP_DUMMY = 0,
+
+#define ENTRY(name, op) BINOP_##name,
+  MACRO_BINOPS(ENTRY)
+#undef ENTRY
+};
+
+enum {
+  LO_1_CONST,
+  LO_1_STRING,
+  LO_1_SEXP,
+  LO_1_STI,
+  LO_1_STA,
+  LO_1_JMP,
+  LO_1_END,
+  LO_1_RET,
+  LO_1_DROP,
+  LO_1_DUP,
+  LO_1_SWAP,
+  LO_1_ELEM,
+};
+
+enum {
+  LO_2_CJMP_Z = 0,
+  LO_2_CJMP_NZ,
+  LO_2_BEGIN,
+  LO_2_CBEGIN,
+  LO_2_CLOSURE,
+  LO_2_CALLC,
+  LO_2_CALL,
+  LO_2_TAG,
+  LO_2_ARRAY,
+  LO_2_FAIL,
+  LO_2_LINE,
+};
+
+enum {
+  BUILTIN_READ = 0,
+  BUILTIN_WRITE,
+  BUILTIN_LENGTH,
+  BUILTIN_STRING,
+  BUILTIN_ARRAY,
+};
+
+enum { MEM_G = 0, MEM_L, MEM_A, MEM_C };
+
+enum {
+  PATT_EQ_STRING = 0,
+  PATT_TAG_STRING,
+  PATT_TAG_ARRAY,
+  PATT_TAG_SEXP,
+  PATT_TAG_REF,
+  PATT_TAG_VAL,
+  PATT_TAG_FUN,
+};
+
+/* Полный байт инструкции: старшая и младшая половины вместе */
+#define OP(h, l) (((h) << 4) | (l))
+
+#define MACRO_MEMS(E)                                                                              \
+  E(G, globals.p + i)                                                                              \
+  E(L, locals + i)                                                                                 \
+  E(A, args - i)                                                                                   \
+  E(C, closed + i)
+
+/* Все инструкции, кроме STOP, которому соответствует целый диапазон байтов */
+#define MACRO_OPCODES(E)                                                                           \
+  MACRO_BINOPS(E##_BINOP)                                                                          \
+  E(CONST, OP(HI_1, LO_1_CONST))                                                                   \
+  E(STRING, OP(HI_1, LO_1_STRING))                                                                 \
+  E(SEXP, OP(HI_1, LO_1_SEXP))                                                                     \
+  E(STI, OP(HI_1, LO_1_STI))                                                                       \
+  E(STA, OP(HI_1, LO_1_STA))                                                                       \
+  E(JMP, OP(HI_1, LO_1_JMP))                                                                       \
+  E(END, OP(HI_1, LO_1_END))                                                                       \
+  E(RET, OP(HI_1, LO_1_RET))                                                                       \
+  E(DROP, OP(HI_1, LO_1_DROP))                                                                     \
+  E(DUP, OP(HI_1, LO_1_DUP))                                                                       \
+  E(SWAP, OP(HI_1, LO_1_SWAP))                                                                     \
+  E(ELEM, OP(HI_1, LO_1_ELEM))                                                                     \
+  MACRO_MEMS(E##_LD)                                                                               \
+  MACRO_MEMS(E##_LDA)                                                                              \
+  MACRO_MEMS(E##_ST)                                                                               \
+  E(CJMP_Z, OP(HI_2, LO_2_CJMP_Z))                                                                 \
+  E(CJMP_NZ, OP(HI_2, LO_2_CJMP_NZ))                                                               \
+  E(BEGIN, OP(HI_2, LO_2_BEGIN))                                                                   \
+  E(CBEGIN, OP(HI_2, LO_2_CBEGIN))                                                                 \
+  E(CLOSURE, OP(HI_2, LO_2_CLOSURE))                                                               \
+  E(CALLC, OP(HI_2, LO_2_CALLC))                                                                   \
+  E(CALL, OP(HI_2, LO_2_CALL))                                                                     \
+  E(TAG, OP(HI_2, LO_2_TAG))                                                                       \
+  E(ARRAY, OP(HI_2, LO_2_ARRAY))                                                                   \
+  E(FAIL, OP(HI_2, LO_2_FAIL))                                                                     \
+  E(LINE, OP(HI_2, LO_2_LINE))                                                                     \
+  E(PATT_EQ_STRING, OP(HI_PATT, PATT_EQ_STRING))                                                   \
+  E(PATT_TAG_STRING, OP(HI_PATT, PATT_TAG_STRING))                                                 \
+  E(PATT_TAG_ARRAY, OP(HI_PATT, PATT_TAG_ARRAY))                                                   \
+  E(PATT_TAG_SEXP, OP(HI_PATT, PATT_TAG_SEXP))                                                     \
+  E(PATT_TAG_REF, OP(HI_PATT, PATT_TAG_REF))                                                       \
+  E(PATT_TAG_VAL, OP(HI_PATT, PATT_TAG_VAL))                                                       \
+  E(PATT_TAG_FUN, OP(HI_PATT, PATT_TAG_FUN))                                                       \
+  E(BUILTIN_READ, OP(HI_BUILTIN, BUILTIN_READ))                                                    \
+  E(BUILTIN_WRITE, OP(HI_BUILTIN, BUILTIN_WRITE))                                                  \
+  E(BUILTIN_LENGTH, OP(HI_BUILTIN, BUILTIN_LENGTH))                                                \
+  E(BUILTIN_STRING, OP(HI_BUILTIN, BUILTIN_STRING))                                                \
+  E(BUILTIN_ARRAY, OP(HI_BUILTIN, BUILTIN_ARRAY))
+
+#define OPCODE_BINOP(name, op) OPCODE_BINOP_##name = OP(HI_BINOP, BINOP_##name),
+#define OPCODE_LD(name, addr) OPCODE_LD_##name = OP(HI_LD, MEM_##name),
+#define OPCODE_LDA(name, addr) OPCODE_LDA_##name = OP(HI_LDA, MEM_##name),
+#define OPCODE_ST(name, addr) OPCODE_ST_##name = OP(HI_ST, MEM_##name),
+#define OPCODE(name, code) OPCODE_##name = code,
+enum { MACRO_OPCODES(OPCODE) };
+#undef OPCODE
+#undef OPCODE_ST
+#undef OPCODE_LDA
+#undef OPCODE_LD
+#undef OPCODE_BINOP
+
+typedef struct {
+  unsigned char *p;
+  size_t         n;
+} slice_uchar;
+
+/* Переменная, захватываемая замыканием */
+typedef struct {
+  int mem;
+  int i;
+} capture;
+
+typedef struct instr instr;
+
+typedef union {
+  int      n;
+  char    *s;
+  instr   *target;
+  capture *captures;
+} operand;
+
+/* Предекодированная инструкция фиксированной ширины.
+   Операнды разобраны один раз при загрузке: переходы указывают прямо
+   на инструкции, строки --- на строковую таблицу, список захватываемых
+   переменных CLOSURE распакован в отдельный массив. У SEXP и TAG
+   в c.n уже лежит хэш тега (результат LtagHash) */
+struct instr {
+  int     op;
+  operand a, b, c;
+};
+
+/* Программа после декодирования */
+typedef struct {
+  instr *p;
+  size_t n;
+  int   *offsets; /* Смещение каждой инструкции в исходном байткоде */
+  int   *index; /* Номер инструкции по смещению в байткоде или -1 */
+  int   *tags; /* Хэш тега по смещению строки в строковой таблице или 0 */
+  /* Заполняются верификатором, для недостижимых инструкций -1 */
+  int *depth; /* Глубина операндного стека перед инструкцией */
+  int *owner; /* Номер инструкции BEGIN/CBEGIN функции, которой принадлежит инструкция */
+} program;
+
+extern slice_uchar code;
+extern program     prog;
+
+/* Инструкция, начинающаяся по смещению addr в байткоде */
+static inline instr *instr_at (size_t addr) {
+  ASSERT_MSG(addr < code.n && prog.index[addr] >= 0,
+             "Jump to address %p which is not a start of instruction, file size %p\n",
+             (void *)addr,
+             (void *)code.n);
+  return prog.p + prog.index[addr];
+}
+
+/* Разбирает байткод в массив инструкций фиксированной ширины */
+void decode (bytefile *bf);
+
+/* Проверяет программу и заполняет глубину стека и принадлежность инструкций функциям */
+void verify (bytefile *bf);
+
+#endif
@@ -3,153 +3,99 @@
 #include "../runtime/gc.h"
 #include "../runtime/runtime.h"
 #include "../runtime/runtime_common.h"
+#include "bytecode.h"
 
 #include <errno.h>
 #include <malloc.h>
 #include <stdio.h>
 #include <string.h>
 
-#define ASSERT_MSG(cond, ...)                                                                      \
-  do {                                                                                             \
-    if (!(cond)) failure(__VA_ARGS__);                                                             \
-  } while (0)
-
 void *__stop_custom_data  = 0;
 void *__start_custom_data = 0;
 
-/* The unpacked representation of bytecode file */
-typedef struct {
-  char          *string_ptr; /* A pointer to the beginning of the string tablei */
-  int           *public_ptr; /* A pointer to the beginning of publics tablei */
-  unsigned char *code_ptr; /* A pointer to the bytecode itselfi */
-  long           size;
-  int            stringtab_size; /* The size (in bytes) of the string tablei */
-  int            global_area_size; /* The size (in words) of global areai */
-  int            public_symbols_number; /* The number of public symbolsi */
-  unsigned char  buffer[0];
-} bytefile;
-
-/* Gets a string from a string table by an index */
-char *get_string (bytefile *f, int pos) { return &f->string_ptr[pos]; }
-
-/* Gets a name for a public symbol */
-char *get_public_name (bytefile *f, int i) { return get_string(f, f->public_ptr[i * 2]); }
-
-/* Gets an offset for a publie symbol */
-int get_public_offset (bytefile *f, int i) { return f->public_ptr[i * 2 + 1]; }
-
-/* Reads a binary bytecode file by name and unpacks it */
-bytefile *read_file (char *fname) {
-  FILE     *f = fopen(fname, "rb");
-  long      size;
-  bytefile *file;
-
-  if (f == 0) { failure("%s\n", strerror(errno)); }
-
-  if (fseek(f, 0, SEEK_END) == -1) { failure("%s\n", strerror(errno)); }
-
-  file = (bytefile *)malloc(sizeof(int) * 3 + sizeof(long) + (size = ftell(f)));
-
-  if (file == 0) { failure("*** FAILURE: unable to allocate memory.\n"); }
-
-  rewind(f);
-
-  if (size != fread(&file->stringtab_size, 1, size, f)) { failure("%s\n", strerror(errno)); }
-
-  fclose(f);
-
-  file->size       = size;
-  file->public_ptr = (int *)file->buffer;
-  file->string_ptr = (char *)(file->public_ptr + 2 * file->public_symbols_number);
-  file->code_ptr   = (unsigned char *)&file->string_ptr[file->stringtab_size];
-
-  return file;
-}
-
+/* Суперинструкции занимают свободные коды 0x80--0xEF.
+   В файле байткода их нет, они появляются при загрузке */
 enum {
-  HI_STOP  = 15,
-  HI_BINOP = 0,
-  HI_1,
-  HI_LD,
-  HI_LDA,
-  HI_ST,
-  HI_2,
-  HI_PATT,
-  HI_BUILTIN,
+  HI_LD_A_LD_A_BINOP = 8,
+  HI_CONST_BINOP,
+  HI_BINOP_CJMP_Z,
+  HI_FUSED,
 };
 
-#define MACRO_BINOPS(E)                                                                            \
-  E(ADD, +)                                                                                        \
-  E(SUB, -)                                                                                        \
-  E(MUL, *)                                                                                        \
-  E(DIV, /)                                                                                        \
-  E(MOD, %)                                                                                        \
-  E(LT, <)                                                                                         \
-  E(LE, <=)                                                                                        \
-  E(GT, >)                                                                                         \
-  E(GE, >=)                                                                                        \
-  E(EQ, ==)                                                                                        \
-  E(NE, !=)                                                                                        \
-  E(AND, &&)                                                                                       \
-  E(OR, ||)
-
 enum {
-  _BINOP_DUMMY = 0,
-
-#define ENTRY(name, op) BINOP_##name,
-  MACRO_BINOPS(ENTRY)
-#undef ENTRY
+  FUSED_DUP_TAG_CJMP_Z = 0,
+  FUSED_DROP_JMP,
 };
 
-enum {
-  LO_1_CONST,
-  LO_1_STRING,
-  LO_1_SEXP,
-  LO_1_STI,
-  LO_1_STA,
-  LO_1_JMP,
-  LO_1_END,
-  LO_1_RET,
-  LO_1_DROP,
-  LO_1_DUP,
-  LO_1_SWAP,
-  LO_1_ELEM,
-};
+#define MACRO_FUSED_OPCODES(E)                                                                     \
+  MACRO_BINOPS(E##_LD_A_LD_A_BINOP)                                                                \
+  MACRO_BINOPS(E##_CONST_BINOP)                                                                    \
+  MACRO_BINOPS(E##_BINOP_CJMP_Z)                                                                   \
+  E(DUP_TAG_CJMP_Z, OP(HI_FUSED, FUSED_DUP_TAG_CJMP_Z))                                            \
+  E(DROP_JMP, OP(HI_FUSED, FUSED_DROP_JMP))
 
-enum {
-  LO_2_CJMP_Z = 0,
-  LO_2_CJMP_NZ,
-  LO_2_BEGIN,
-  LO_2_CBEGIN,
-  LO_2_CLOSURE,
-  LO_2_CALLC,
-  LO_2_CALL,
-  LO_2_TAG,
-  LO_2_ARRAY,
-  LO_2_FAIL,
-  LO_2_LINE,
-};
+/* Шаблонный JIT есть только для i386 */
+#ifdef __i386__
+#  define JIT_SUPPORTED
+#endif
+
+/* Служебные инструкции JIT, тоже появляются только при загрузке:
+   JIT_BEGIN --- BEGIN функции, у которой считаются вызовы,
+   JIT_ENTER --- точка входа в скомпилированный код */
+enum { HI_JIT = 12 };
 
 enum {
-  BUILTIN_READ = 0,
-  BUILTIN_WRITE,
-  BUILTIN_LENGTH,
-  BUILTIN_STRING,
-  BUILTIN_ARRAY,
+  JIT_BEGIN = 0,
+  JIT_ENTER,
 };
 
-enum { MEM_G = 0, MEM_L, MEM_A, MEM_C };
+#ifdef JIT_SUPPORTED
+#  define MACRO_JIT_OPCODES(E)                                                                     \
+    E(JIT_BEGIN, OP(HI_JIT, JIT_BEGIN))                                                            \
+    E(JIT_ENTER, OP(HI_JIT, JIT_ENTER))
+#else
+#  define MACRO_JIT_OPCODES(E)
+#endif
+
+/* Хвостовые вызовы: CALL или CALLC, за которыми сразу идёт END.
+   Появляются при загрузке, переиспользуют фрейм вызывающей функции */
+enum { HI_TAIL = 13 };
 
 enum {
-  PATT_EQ_STRING = 0,
-  PATT_TAG_STRING,
-  PATT_TAG_ARRAY,
-  PATT_TAG_SEXP,
-  PATT_TAG_REF,
-  PATT_TAG_VAL,
-  PATT_TAG_FUN,
+  TAIL_CALL = 0,
+  TAIL_CALLC,
 };
 
+#define MACRO_TAIL_OPCODES(E)                                                                      \
+  E(TAIL_CALL, OP(HI_TAIL, TAIL_CALL))                                                             \
+  E(TAIL_CALLC, OP(HI_TAIL, TAIL_CALLC))
+
+#define MACRO_ALL_OPCODES(E)                                                                       \
+  MACRO_OPCODES(E)                                                                                 \
+  MACRO_FUSED_OPCODES(E)                                                                           \
+  MACRO_JIT_OPCODES(E)                                                                             \
+  MACRO_TAIL_OPCODES(E)
+
+#define OPCODE_LD_A_LD_A_BINOP(name, op)                                                           \
+  OPCODE_LD_A_LD_A_BINOP_##name = OP(HI_LD_A_LD_A_BINOP, BINOP_##name),
+#define OPCODE_CONST_BINOP(name, op) OPCODE_CONST_BINOP_##name = OP(HI_CONST_BINOP, BINOP_##name),
+#define OPCODE_BINOP_CJMP_Z(name, op)                                                              \
+  OPCODE_BINOP_CJMP_Z_##name = OP(HI_BINOP_CJMP_Z, BINOP_##name),
+#define OPCODE(name, code) OPCODE_##name = code,
+enum { MACRO_FUSED_OPCODES(OPCODE) MACRO_JIT_OPCODES(OPCODE) MACRO_TAIL_OPCODES(OPCODE) };
+#undef OPCODE
+#undef OPCODE_BINOP_CJMP_Z
+#undef OPCODE_CONST_BINOP
+#undef OPCODE_LD_A_LD_A_BINOP
+
+/* Способ диспетчеризации выбирается при сборке.
+   По умолчанию используется шитый код (computed goto) ---
+   таблица из 256 меток, индексируемая байтом инструкции.
+   С -DSWITCH_DISPATCH остаётся переносимый вариант с одним switch. */
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#  define THREADED_DISPATCH
+#endif
+
 extern size_t __gc_stack_top, __gc_stack_bottom;
 
 /* Т.к. сборщик мусора рассчитан на один стек,
@@ -162,29 +108,25 @@ typedef struct {
   size_t  n;
 } slice_size_t;
 
-typedef struct {
-  unsigned char *p;
-  size_t         n;
-} slice_uchar;
-
 /* Данные виртуальной машины будем хранить глобально,
    чтобы можно было легко писать вспомогательные функции,
    тем более что всё равно нужен глобальный стек */
 static slice_size_t globals = {};
-static slice_size_t args    = {};
-static slice_size_t locals  = {};
-static slice_size_t closed  = {};
 
-static size_t *p_stack_frame = 0;
+/* Переменные текущей функции, см. frame */
+static size_t *args   = 0;
+static size_t *locals = 0;
+static size_t *closed = 0;
+
+static instr *p_instr = 0;
 
-slice_uchar           code       = {};
-static unsigned char *p_instr    = 0;
-void                 *instr_desc = 0;
+/* Позиция текущей инструкции в байткоде для сообщений об ошибках */
+static inline void *instr_desc () { return (void *)(size_t)prog.offsets[p_instr - prog.p]; }
 
 static inline size_t *s_top () { return (size_t *)__gc_stack_top + 1; }
 
 static inline void s_push (size_t x) {
-  ASSERT_MSG(__gc_stack_top >= (size_t)stack_data, "Stack overflow at %p\n", instr_desc);
+  DEBUG_ASSERT_MSG(__gc_stack_top >= (size_t)stack_data, "Stack overflow at %p\n", instr_desc());
   *(size_t *)__gc_stack_top = x;
   __gc_stack_top -= sizeof(size_t);
 }
@@ -192,153 +134,646 @@ static inline void s_push (size_t x) {
 static inline size_t s_pop () {
   __gc_stack_top += sizeof(size_t);
   /* Глобальные переменные никогда не должны быть сняты со стека */
-  ASSERT_MSG(__gc_stack_top < (size_t)globals.p, "Stack underflow at %p\n", instr_desc);
+  DEBUG_ASSERT_MSG(__gc_stack_top < (size_t)globals.p, "Stack underflow at %p\n", instr_desc());
   size_t res = *(size_t *)__gc_stack_top;
   return res;
 }
 
-static inline void checked_jmp (size_t addr) {
-  ASSERT_MSG(addr < code.n,
-             "Jump to address %p with file size %p at %p\n",
-             (void *)addr,
-             (void *)code.n,
-             instr_desc);
-  p_instr = code.p + addr;
-}
-
-static inline size_t n_vars (int mem_type) {
-  switch (mem_type) {
-    case MEM_G: return globals.n;
-    case MEM_L: return locals.n;
-    case MEM_A: return args.n;
-    case MEM_C: return closed.n;
-    default:
-      failure("Incorrect memory type: %d\n", mem_type);
-      return 0; /* Подавляем предупреждение компилятора */
-  }
-}
-
-static inline void check_nvars (int mem_type, int i) {
-  size_t n = n_vars(mem_type);
-  ASSERT_MSG((size_t)i < n,
-             "Addressing %dth variable of type %d when only %d exist at %p\n",
-             i,
-             mem_type,
-             n,
-             instr_desc);
+/* Проверяет, что на стеке есть место ещё для words слов.
+   Верификатор посчитал, сколько нужно каждой функции,
+   так что это единственная проверка переполнения стека */
+static inline void check_headroom (int words) {
+  ASSERT_MSG(__gc_stack_top >= (size_t)stack_data + (words - 1) * sizeof(size_t),
+             "Stack overflow at %p\n",
+             instr_desc());
 }
 
-/* Barray, Bsexp и Bclosure не подходят, т.к. в них элементы передаются через varargs */
+/* Barray, Bsexp и Bclosure не подходят, т.к. в них элементы передаются через varargs.
+   Все поля заполняются сразу, до следующего выделения памяти,
+   поэтому память берётся через alloc_uninitialized без обнуления.
+   Большой объект может сразу оказаться в старом поколении,
+   поэтому заполненный объект показываем барьеру записи */
 static size_t Warray (int n) {
-  data *obj = alloc_array(n);
-  int  *arr = (int *)obj->contents;
+  int *arr = init_object_header(alloc_uninitialized(array_size(n)), ARRAY_TAG, n);
   for (int i = 0; i < n; ++i) {
     int x          = s_pop();
     arr[n - 1 - i] = x;
   }
-  return (size_t)obj->contents;
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
+}
+
+/* x : xs --- ячейка cons без слова тега, см. alloc_cons */
+static size_t Wcons (void) {
+  int *arr = init_object_header(alloc_uninitialized(cons_size()), CONS_TAG, 2);
+  arr[1]   = s_pop();
+  arr[0]   = s_pop();
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
 }
 
-static size_t Wsexp (char *tag, int n) {
-  sexp *s   = alloc_sexp(n);
-  data *obj = (data *)s;
-  int  *arr = (int *)obj->contents;
-  s->tag    = UNBOX(LtagHash(tag));
+static size_t Wsexp (int hash, int n) {
+  if (UNBOX(hash) == CONS_TAG_HASH && n == 2) { return Wcons(); }
+  int *arr = init_object_header(alloc_uninitialized(sexp_size(n)), SEXP_TAG, n);
+  arr[0]   = UNBOX(hash);
   for (int i = 0; i < n; ++i) {
     int x      = s_pop();
     arr[n - i] = x;
   }
-  return (size_t)obj->contents;
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
 }
 
 static size_t Wclosure (int entry, int n) {
-  data *obj = alloc_closure(n + 1);
-  int  *arr = (int *)obj->contents;
-  arr[0]    = entry;
+  int *arr = init_object_header(alloc_uninitialized(closure_size(n + 1)), CLOSURE_TAG, n + 1);
+  arr[0]   = entry;
   for (int i = 0; i < n; ++i) {
     size_t x   = s_pop();
     arr[n - i] = x;
   }
-  return (size_t)obj->contents;
+  gc_write_barrier_obj(arr);
+  return (size_t)arr;
 }
 
-/* Структура стекового фрейма:
+/* Структура стекового фрейма, от старших адресов к младшим:
    - [Опционально] Объект замыкания
    - Аргументы функции
-   - Адрес возврата в виде числа, ещё один бит сообщает о замыкании
+   - Заголовок фрейма (frame), его верхнее слово --- адрес возврата
    - Локальные переменные
-   - Количество аргументов
-   - Количество локальных переменных
-   - Адрес предыдущего стекового фрейма
 
-   Указатели на стек и на код будем записывать как числа,
-   чтобы сборщик мусора не пытался их обрабатывать как объекты.
+   Заголовок фиксированного размера, поэтому вход в функцию --- это
+   заполнение заголовка, обнуление локальных переменных и сдвиг указателя
+   стека, а выход --- возврат указателя стека к аргументам.
+
+   Метаданные хранятся без BOX: указатели на стек и номера инструкций
+   лежат вне кучи, и сборщик мусора их пропускает. Объект замыкания
+   сборщик мусора обновляет как обычный корень, поэтому closed
+   вычисляется из него заново после каждого возврата и после каждого
+   вызова, который может передвинуть объекты (RELOAD).
 
    Будем считать, что байткод корректен, допускаем неопределённое поведение,
-   т.к. его же допускает исходная реализация Ламы.
-
-   Будем добавлять 1 в младший бит указателей не на кучу Ламы,
-   чтобы сборщик мусора считал их целыми числами. */
-
-static inline void do_begin () {
-  /* Адрес возврата, замыкание, аргументы */
-  size_t *stack_top = s_top();
-  args.p            = stack_top + args.n;
-  int ret_addr      = stack_top[0];
-  if (ret_addr & 0x80000000) {
-    /* Замыкание */
-    size_t closure = args.p[1];
-    data  *obj     = TO_DATA(closure);
-    closed.n       = LEN(obj->data_header) - 1;
-    closed.p       = (size_t *)obj->contents + 1;
-  } else {
-    /* Обычная функция, без замыкания */
-    closed.n = 0;
-    closed.p = 0;
-  }
+   т.к. его же допускает исходная реализация Ламы. */
+typedef struct frame frame;
+struct frame {
+  frame  *prev;    /* Фрейм вызывающей функции, 0 у главной */
+  size_t *locals;  /* Первая локальная переменная */
+  size_t *args;    /* Первый аргумент, остальные ниже */
+  size_t  closure; /* Объект замыкания или 0 */
+  size_t  ret;     /* Номер инструкции возврата, кладёт CALL/CALLC. Бит 31 --- вызов замыкания */
+};
+
+static frame *p_stack_frame = 0;
+
+static inline void set_frame (frame *f) {
+  p_stack_frame = f;
+  args          = f->args;
+  locals        = f->locals;
+  closed        = f->closure ? (size_t *)f->closure + 1 : 0;
+}
+
+/* Адрес возврата уже на вершине стека, заголовок продолжается под ним */
+static inline void do_begin (int nargs, int nlocals) {
+  frame *f   = (frame *)(s_top() + 1) - 1;
+  f->prev    = p_stack_frame;
+  f->args    = (size_t *)&f->ret + nargs;
+  f->closure = f->ret & 0x80000000 ? f->args[1] : 0;
+  f->locals  = (size_t *)f - nlocals;
 
-  /* Выделим место для локальных переменных.
-     Их обязательно нужно занулять,
+  /* Локальные переменные обязательно нужно занулять,
      чтобы сборщик мусора не принимал
      неинициализированные переменные за указатели. */
-  for (int i = 0; i < locals.n; ++i) s_push(0);
-  locals.p = s_top();
+  memset(f->locals, 0, nlocals * sizeof(size_t));
+  __gc_stack_top = (size_t)(f->locals - 1);
+  set_frame(f);
+}
+
+/* Хвостовой вызов: words слов с вершины стека (замыкание и аргументы)
+   переносятся на место аргументов текущей функции, и её фрейм снимается.
+   Адрес возврата остаётся прежним, меняется только признак замыкания.
+   Если у вызываемой функции аргументов больше, они затирают заголовок фрейма,
+   поэтому ret и prev читаются до переноса.
+   Возвращает указатель стека, на вершине которого лежит адрес возврата */
+static inline size_t *tail_call (size_t *sp, int words, size_t closure_bit) {
+  frame  *f    = p_stack_frame;
+  frame  *prev = f->prev;
+  size_t  ret  = f->ret & 0x7FFFFFFF;
+  size_t *top  = f->args + (f->closure != 0);
+  memmove(top - words + 1, sp + 1, words * sizeof(size_t));
+  top[-words]   = ret | closure_bit;
+  p_stack_frame = prev;
+  return top - words - 1;
+}
 
-  s_push(BOX(args.n));
-  s_push(BOX(locals.n));
+/* Образец суперинструкции: последовательность кодов инструкций с масками.
+   Код суперинструкции получает младшие биты кода инструкции номер lo_from.
+   Суперинструкция заменяет только код первой инструкции последовательности,
+   её операнды обработчик читает из следующих инструкций, которые остаются
+   на месте. Поэтому переходы в середину последовательности работают как раньше */
+typedef struct {
+  int len;
+  struct {
+    int op, mask;
+  } seq[3];
+  int fused;
+  int lo_from;
+} fusion;
+
+/* Типичные для кода lamac последовательности: арифметика над аргументами,
+   операции с константой, условия циклов, сопоставление с образцом и выход из ветки.
+   Частоты пар можно проверить сборкой с OPCODE_STATS. Длинные образцы идут раньше */
+static const fusion fusions[] = {
+    {3,
+     {{OPCODE_LD_A, 0xFF}, {OPCODE_LD_A, 0xFF}, {OP(HI_BINOP, 0), 0xF0}},
+     OP(HI_LD_A_LD_A_BINOP, 0),
+     2},
+    {3,
+     {{OPCODE_DUP, 0xFF}, {OPCODE_TAG, 0xFF}, {OPCODE_CJMP_Z, 0xFF}},
+     OPCODE_DUP_TAG_CJMP_Z,
+     -1},
+    {2, {{OPCODE_CONST, 0xFF}, {OP(HI_BINOP, 0), 0xF0}}, OP(HI_CONST_BINOP, 0), 1},
+    {2, {{OP(HI_BINOP, 0), 0xF0}, {OPCODE_CJMP_Z, 0xFF}}, OP(HI_BINOP_CJMP_Z, 0), 0},
+    {2, {{OPCODE_DROP, 0xFF}, {OPCODE_JMP, 0xFF}}, OPCODE_DROP_JMP, -1},
+};
 
-  /* Где находится предыдущий стековый фрейм */
-  s_push((size_t)p_stack_frame);
-  p_stack_frame = s_top();
+/* Заменяет частые последовательности инструкций суперинструкциями.
+   Выполняется после верификации, которая видит исходные инструкции */
+static void fuse () {
+  for (size_t k = 0; k < prog.n; ++k) {
+    for (size_t f = 0; f < sizeof(fusions) / sizeof(fusions[0]); ++f) {
+      const fusion *fu = fusions + f;
+      bool          ok = k + fu->len <= prog.n;
+      for (int j = 0; ok && j < fu->len; ++j) {
+        ok = (prog.p[k + j].op & fu->seq[j].mask) == fu->seq[j].op;
+      }
+      if (ok) {
+        prog.p[k].op = fu->fused | (fu->lo_from < 0 ? 0 : prog.p[k + fu->lo_from].op & 0x0F);
+        break;
+      }
+    }
+  }
 }
 
-static int instr_int () {
-  ASSERT_MSG(p_instr + sizeof(int) <= code.p + code.n,
-             "Unexpected end of bytecode when reading integer argument at %p\n",
-             (void *)(p_instr - code.p));
-  int res = *(int *)p_instr;
-  p_instr += sizeof(int);
-  return res;
+/* Код первой инструкции последовательности, которую заменила суперинструкция op */
+static int unfuse (int op) {
+  for (size_t f = 0; f < sizeof(fusions) / sizeof(fusions[0]); ++f) {
+    const fusion *fu = fusions + f;
+    if (fu->lo_from < 0 ? op == fu->fused : (op & 0xF0) == fu->fused) {
+      return fu->seq[0].mask == 0xFF ? fu->seq[0].op : fu->seq[0].op | (op & 0x0F);
+    }
+  }
+  return op;
+}
+
+/* Ведёт ли инструкция k сразу к END, возможно, через безусловные переходы.
+   Так lamac завершает ветки if и case */
+static bool reaches_end (instr *in) {
+  for (size_t steps = 0; in->op == OPCODE_JMP && steps < prog.n; ++steps) in = in->a.target;
+  return in->op == OPCODE_END;
+}
+
+/* Помечает вызовы, после которых идёт END, как хвостовые.
+   Переходы на сам END при этом продолжают работать.
+   Вызовы в главной функции (с инструкции 0) остаются обычными:
+   у её фрейма нет вызывающего, и f->args указывает на глобальные переменные
+   или за конец stack_data, так что переносить туда аргументы нельзя */
+static void mark_tail_calls () {
+  for (size_t k = 0; k + 1 < prog.n; ++k) {
+    if (prog.owner[k] == 0 || !reaches_end(prog.p + k + 1)) continue;
+    if (prog.p[k].op == OPCODE_CALL) prog.p[k].op = OPCODE_TAIL_CALL;
+    if (prog.p[k].op == OPCODE_CALLC) prog.p[k].op = OPCODE_TAIL_CALLC;
+  }
+}
+
+#ifdef OPCODE_STATS
+/* Подсчёт частот пар подряд исполненных инструкций, по нему выбираются суперинструкции.
+   Исходные пары видны при запуске с --no-fuse */
+static unsigned long long pair_stats[256][256];
+static int                prev_op = 0;
+
+#  define OPCODE_NAME_BINOP(name, op) [OPCODE_BINOP_##name] = "BINOP " #op,
+#  define OPCODE_NAME_LD(name, addr) [OPCODE_LD_##name] = "LD " #name,
+#  define OPCODE_NAME_LDA(name, addr) [OPCODE_LDA_##name] = "LDA " #name,
+#  define OPCODE_NAME_ST(name, addr) [OPCODE_ST_##name] = "ST " #name,
+#  define OPCODE_NAME_LD_A_LD_A_BINOP(name, op)                                                    \
+    [OPCODE_LD_A_LD_A_BINOP_##name] = "LD A; LD A; BINOP " #op,
+#  define OPCODE_NAME_CONST_BINOP(name, op) [OPCODE_CONST_BINOP_##name] = "CONST; BINOP " #op,
+#  define OPCODE_NAME_BINOP_CJMP_Z(name, op) [OPCODE_BINOP_CJMP_Z_##name] = "BINOP " #op "; CJMPz",
+#  define OPCODE_NAME(name, code) [OPCODE_##name] = #name,
+static const char *opcode_names[256] = {MACRO_ALL_OPCODES(OPCODE_NAME)};
+#  undef OPCODE_NAME
+#  undef OPCODE_NAME_BINOP_CJMP_Z
+#  undef OPCODE_NAME_CONST_BINOP
+#  undef OPCODE_NAME_LD_A_LD_A_BINOP
+#  undef OPCODE_NAME_ST
+#  undef OPCODE_NAME_LDA
+#  undef OPCODE_NAME_LD
+#  undef OPCODE_NAME_BINOP
+
+static inline void count_op (int op) {
+  ++pair_stats[prev_op][op];
+  prev_op = op;
+}
+
+/* Печатает самые частые пары в stderr */
+static void print_opcode_stats () {
+  for (int top = 0; top < 32; ++top) {
+    int                best_x = 0, best_y = 0;
+    unsigned long long best = 0;
+    for (int x = 0; x < 256; ++x) {
+      for (int y = 0; y < 256; ++y) {
+        if (pair_stats[x][y] > best) {
+          best   = pair_stats[x][y];
+          best_x = x;
+          best_y = y;
+        }
+      }
+    }
+    if (best == 0) break;
+    fprintf(stderr,
+            "%12llu  %s -> %s\n",
+            best,
+            opcode_names[best_x] ? opcode_names[best_x] : "?",
+            opcode_names[best_y] ? opcode_names[best_y] : "?");
+    pair_stats[best_x][best_y] = 0;
+  }
+}
+#endif
+
+#ifdef JIT_SUPPORTED
+/* Шаблонный JIT для i386.
+
+   Функция компилируется целиком после JIT_THRESHOLD вызовов: код каждой
+   инструкции склеивается из готового шаблона. Стек, фреймы и __gc_stack_top
+   те же, что у интерпретатора, поэтому из машинного кода в интерпретатор
+   можно выйти на любой инструкции. Так сделано для всего, что выделяет память,
+   работает с фреймами или редко встречается: BEGIN, END, CALL, SEXP и т.п.
+   Интерпретатор исполняет такую инструкцию и возвращается в машинный код
+   на следующей, для этого она помечается как JIT_ENTER.
+
+   Регистры в машинном коде:
+   esi --- указатель стека, как __gc_stack_top (вершина в [esi + 4]),
+   ebx --- locals, edi --- args. Они не меняются, пока не выйдем
+   в интерпретатор. eax, ecx, edx --- временные.
+
+   Машинный код не выделяет память и не вызывает сборщик мусора,
+   поэтому __gc_stack_top достаточно обновлять при выходе. */
+
+#  define JIT_CODE_SIZE (16 * 1024 * 1024)
+#  define JIT_THRESHOLD 16
+/* Оценка сверху для шаблона одной инструкции вместе с заглушкой выхода */
+#  define JIT_MAX_INSTR_BYTES 64
+/* Место под аргументы вызываемых функций рантайма, вместе с сохранёнными
+   регистрами и адресом возврата выравнивает стек по 16 байт */
+#  define JIT_OUTGOING_BYTES 28
+
+/* Переход, поле rel32 которого нужно заполнить после компиляции функции */
+typedef struct {
+  size_t         k;
+  unsigned char *at;
+} jit_fixup;
+
+/* Входит в машинный код по адресу target, возвращает номер инструкции,
+   с которой должен продолжить интерпретатор */
+typedef int (*jit_entry_fn)(void *target);
+
+static bool            jit_enabled   = false;
+static int             jit_threshold = JIT_THRESHOLD;
+static int            *jit_ops       = 0; /* Исходные коды инструкций */
+static int            *jit_calls     = 0; /* Счётчики вызовов для BEGIN */
+static unsigned char **jit_native    = 0; /* Машинный код каждой инструкции */
+static unsigned char  *jit_buf       = 0;
+static unsigned char  *jit_pos       = 0;
+static unsigned char  *jit_exit      = 0;
+static jit_entry_fn    jit_run       = 0;
+
+static void jit_emit (int n, ...) {
+  va_list bytes;
+  va_start(bytes, n);
+  for (int i = 0; i < n; ++i) *jit_pos++ = va_arg(bytes, int);
+  va_end(bytes);
+}
+
+static void jit_int (int x) {
+  memcpy(jit_pos, &x, sizeof(int));
+  jit_pos += sizeof(int);
+}
+
+static void jit_addr (void *p) { jit_int((int)(size_t)p); }
+
+/* Смещение rel32 до target от конца поля по адресу at */
+static void jit_patch_rel (unsigned char *at, void *target) {
+  int rel = (unsigned char *)target - (at + sizeof(int));
+  memcpy(at, &rel, sizeof(int));
+}
+
+static void jit_rel (void *target) {
+  jit_patch_rel(jit_pos, target);
+  jit_pos += sizeof(int);
+}
+
+/* Выход в интерпретатор с инструкции k */
+static void jit_emit_exit (size_t k) {
+  jit_emit(1, 0xB8); /* mov eax, k */
+  jit_int(k);
+  jit_emit(1, 0xE9); /* jmp jit_exit */
+  jit_rel(jit_exit);
+}
+
+/* Кладёт eax на стек */
+static void jit_emit_push_eax () {
+  jit_emit(2, 0x89, 0x06);       /* mov [esi], eax */
+  jit_emit(3, 0x83, 0xEE, 0x04); /* sub esi, 4 */
+}
+
+/* Вызов функции рантайма, которая не выделяет память.
+   Аргументы --- nstack верхних элементов стека (глубже лежащий идёт первым)
+   и nimm констант, результат заменяет эти элементы */
+static void jit_emit_call (void *fn, int nstack, int nimm, int imm0, int imm1) {
+  int imms[2] = {imm0, imm1};
+  int arg     = 0;
+  for (int j = 0; j < nstack; ++j, ++arg) {
+    jit_emit(3, 0x8B, 0x46, 4 * (nstack - j)); /* mov eax, [esi + 4 * (nstack - j)] */
+    jit_emit(4, 0x89, 0x44, 0x24, 4 * arg);    /* mov [esp + 4 * arg], eax */
+  }
+  for (int j = 0; j < nimm; ++j, ++arg) {
+    jit_emit(4, 0xC7, 0x44, 0x24, 4 * arg); /* mov dword [esp + 4 * arg], imm */
+    jit_int(imms[j]);
+  }
+  jit_emit(1, 0xE8); /* call fn */
+  jit_rel(fn);
+  if (nstack == 0) {
+    jit_emit_push_eax();
+    return;
+  }
+  if (nstack > 1) jit_emit(3, 0x83, 0xC6, 4 * (nstack - 1)); /* add esi, 4 * (nstack - 1) */
+  jit_emit(3, 0x89, 0x46, 0x04);                             /* mov [esi + 4], eax */
+}
+
+static void jit_emit_binop (int binop) {
+  jit_emit(3, 0x8B, 0x4E, 0x04); /* mov ecx, [esi + 4] */
+  jit_emit(3, 0x83, 0xC6, 0x04); /* add esi, 4 */
+  jit_emit(3, 0x8B, 0x46, 0x04); /* mov eax, [esi + 4] */
+  jit_emit(2, 0xD1, 0xF8);       /* sar eax, 1 */
+  jit_emit(2, 0xD1, 0xF9);       /* sar ecx, 1 */
+  switch (binop) {
+    case BINOP_ADD: jit_emit(2, 0x01, 0xC8); break;       /* add eax, ecx */
+    case BINOP_SUB: jit_emit(2, 0x29, 0xC8); break;       /* sub eax, ecx */
+    case BINOP_MUL: jit_emit(3, 0x0F, 0xAF, 0xC1); break; /* imul eax, ecx */
+    case BINOP_DIV: jit_emit(3, 0x99, 0xF7, 0xF9); break; /* cdq; idiv ecx */
+    case BINOP_MOD:
+      jit_emit(3, 0x99, 0xF7, 0xF9); /* cdq; idiv ecx */
+      jit_emit(2, 0x89, 0xD0);       /* mov eax, edx */
+      break;
+    case BINOP_LT:
+    case BINOP_LE:
+    case BINOP_GT:
+    case BINOP_GE:
+    case BINOP_EQ:
+    case BINOP_NE: {
+      static const unsigned char setcc[] = {
+          [BINOP_LT] = 0x9C, /* setl */
+          [BINOP_LE] = 0x9E, /* setle */
+          [BINOP_GT] = 0x9F, /* setg */
+          [BINOP_GE] = 0x9D, /* setge */
+          [BINOP_EQ] = 0x94, /* sete */
+          [BINOP_NE] = 0x95, /* setne */
+      };
+      jit_emit(2, 0x39, 0xC8);               /* cmp eax, ecx */
+      jit_emit(3, 0x0F, setcc[binop], 0xC0); /* setcc al */
+      jit_emit(3, 0x0F, 0xB6, 0xC0);         /* movzx eax, al */
+      break;
+    }
+    case BINOP_AND:
+    case BINOP_OR:
+      jit_emit(2, 0x85, 0xC0);                             /* test eax, eax */
+      jit_emit(3, 0x0F, 0x95, 0xC0);                       /* setne al */
+      jit_emit(2, 0x85, 0xC9);                             /* test ecx, ecx */
+      jit_emit(3, 0x0F, 0x95, 0xC1);                       /* setne cl */
+      jit_emit(2, binop == BINOP_AND ? 0x20 : 0x08, 0xC8); /* and/or al, cl */
+      jit_emit(3, 0x0F, 0xB6, 0xC0);                       /* movzx eax, al */
+      break;
+  }
+  jit_emit(4, 0x8D, 0x44, 0x00, 0x01); /* lea eax, [eax + eax + 1] */
+  jit_emit(3, 0x89, 0x46, 0x04);       /* mov [esi + 4], eax */
 }
 
-static unsigned char instr_byte () {
-  ASSERT_MSG(p_instr < code.p + code.n,
-             "Unexpected end of bytecode when reading byte at %p\n",
-             (void *)(p_instr - code.p));
-  return *p_instr++;
+/* Значение, которое LDA кладёт на стек для адреса переменной в eax */
+static void jit_emit_lda_eax () {
+  jit_emit(1, 0x2D); /* sub eax, stack_data */
+  jit_addr(stack_data);
+  jit_emit(2, 0xD1, 0xE8); /* shr eax, 1 */
+  jit_emit(1, 0x0D);       /* or eax, 0x40000001 */
+  jit_int(0x40000000 | 1);
 }
 
-static inline char *instr_string (bytefile *bf) {
-  int pos = instr_int();
-  ASSERT_MSG(
-      (size_t)pos < bf->stringtab_size,
-      "Incorrect shift %d for string, string table size is %d when reading string argument at %p\n",
-      pos,
-      bf->stringtab_size,
-      (void *)(p_instr - sizeof(int) - code.p));
-  return get_string(bf, pos);
+/* Шаблон инструкции k. Возвращает false, если её исполняет интерпретатор.
+   Переходы записываются в fixups и разрешаются после компиляции функции */
+static bool jit_emit_instr (size_t k, jit_fixup *fixups, size_t *nfixups) {
+  instr *in = prog.p + k;
+  int    op = unfuse(jit_ops[k]);
+  int    i  = in->a.n;
+
+  switch (op >> 4) {
+    case HI_BINOP: jit_emit_binop(op & 0x0F); return true;
+    case HI_LD:
+      switch (op & 0x0F) {
+        case MEM_G:
+          jit_emit(1, 0xA1); /* mov eax, [globals.p + i] */
+          jit_addr(globals.p + i);
+          break;
+        case MEM_L:
+          jit_emit(2, 0x8B, 0x83); /* mov eax, [ebx + 4 * i] */
+          jit_int(4 * i);
+          break;
+        case MEM_A:
+          jit_emit(2, 0x8B, 0x87); /* mov eax, [edi - 4 * i] */
+          jit_int(-4 * i);
+          break;
+        default: return false;
+      }
+      jit_emit_push_eax();
+      return true;
+    case HI_LDA:
+      switch (op & 0x0F) {
+        case MEM_G:
+          jit_emit(1, 0xB8); /* mov eax, globals.p + i */
+          jit_addr(globals.p + i);
+          break;
+        case MEM_L:
+          jit_emit(2, 0x8D, 0x83); /* lea eax, [ebx + 4 * i] */
+          jit_int(4 * i);
+          break;
+        case MEM_A:
+          jit_emit(2, 0x8D, 0x87); /* lea eax, [edi - 4 * i] */
+          jit_int(-4 * i);
+          break;
+        default: return false;
+      }
+      jit_emit_lda_eax();
+      jit_emit_push_eax();
+      return true;
+    case HI_ST:
+      switch (op & 0x0F) {
+        case MEM_G:
+          jit_emit(3, 0x8B, 0x46, 0x04); /* mov eax, [esi + 4] */
+          jit_emit(1, 0xA3);             /* mov [globals.p + i], eax */
+          jit_addr(globals.p + i);
+          return true;
+        case MEM_L:
+          jit_emit(3, 0x8B, 0x46, 0x04); /* mov eax, [esi + 4] */
+          jit_emit(2, 0x89, 0x83);       /* mov [ebx + 4 * i], eax */
+          jit_int(4 * i);
+          return true;
+        case MEM_A:
+          jit_emit(3, 0x8B, 0x46, 0x04); /* mov eax, [esi + 4] */
+          jit_emit(2, 0x89, 0x87);       /* mov [edi - 4 * i], eax */
+          jit_int(-4 * i);
+          return true;
+        default: return false;
+      }
+  }
+
+  switch (op) {
+    case OPCODE_CONST:
+      jit_emit(2, 0xC7, 0x06); /* mov dword [esi], BOX(i) */
+      jit_int(BOX(i));
+      jit_emit(3, 0x83, 0xEE, 0x04); /* sub esi, 4 */
+      return true;
+    case OPCODE_DROP: jit_emit(3, 0x83, 0xC6, 0x04); return true; /* add esi, 4 */
+    case OPCODE_DUP:
+      jit_emit(3, 0x8B, 0x46, 0x04); /* mov eax, [esi + 4] */
+      jit_emit_push_eax();
+      return true;
+    case OPCODE_LINE: return true;
+    case OPCODE_JMP:
+      jit_emit(1, 0xE9); /* jmp target */
+      break;
+    case OPCODE_CJMP_Z:
+    case OPCODE_CJMP_NZ:
+      jit_emit(3, 0x83, 0xC6, 0x04);                        /* add esi, 4 */
+      jit_emit(2, 0x8B, 0x06);                              /* mov eax, [esi] */
+      jit_emit(2, 0xD1, 0xF8);                              /* sar eax, 1 */
+      jit_emit(2, 0x0F, op == OPCODE_CJMP_Z ? 0x84 : 0x85); /* jz/jnz target */
+      break;
+    case OPCODE_ELEM: jit_emit_call(Belem, 2, 0, 0, 0); return true;
+    case OPCODE_TAG: jit_emit_call(Btag, 1, 2, in->c.n, BOX(in->b.n)); return true;
+    case OPCODE_ARRAY: jit_emit_call(Barray_patt, 1, 1, BOX(i), 0); return true;
+    case OPCODE_PATT_EQ_STRING: jit_emit_call(Bstring_patt, 2, 0, 0, 0); return true;
+    case OPCODE_PATT_TAG_STRING: jit_emit_call(Bstring_tag_patt, 1, 0, 0, 0); return true;
+    case OPCODE_PATT_TAG_ARRAY: jit_emit_call(Barray_tag_patt, 1, 0, 0, 0); return true;
+    case OPCODE_PATT_TAG_SEXP: jit_emit_call(Bsexp_tag_patt, 1, 0, 0, 0); return true;
+    case OPCODE_PATT_TAG_REF: jit_emit_call(Bboxed_patt, 1, 0, 0, 0); return true;
+    case OPCODE_PATT_TAG_VAL: jit_emit_call(Bunboxed_patt, 1, 0, 0, 0); return true;
+    case OPCODE_PATT_TAG_FUN: jit_emit_call(Bclosure_tag_patt, 1, 0, 0, 0); return true;
+    case OPCODE_BUILTIN_READ: jit_emit_call(Lread, 0, 0, 0, 0); return true;
+    case OPCODE_BUILTIN_WRITE: jit_emit_call(Lwrite, 1, 0, 0, 0); return true;
+    case OPCODE_BUILTIN_LENGTH: jit_emit_call(Llength, 1, 0, 0, 0); return true;
+    default: return false;
+  }
+
+  /* Переход: поле rel32 заполнится позже */
+  fixups[*nfixups].k  = k;
+  fixups[*nfixups].at = jit_pos;
+  ++*nfixups;
+  jit_int(0);
+  return true;
+}
+
+static void jit_protect (int prot) {
+  if (mprotect(jit_buf, JIT_CODE_SIZE, prot) != 0) failure("JIT: %s\n", strerror(errno));
 }
 
+/* Компилирует функцию, которая начинается с BEGIN номер k */
+static void jit_compile (size_t k) {
+  /* Больше вызовы не считаем, даже если скомпилировать не получится */
+  prog.p[k].op = jit_ops[k];
+
+  size_t end = k + 1;
+  while (end < prog.n && jit_ops[end] != OPCODE_BEGIN && jit_ops[end] != OPCODE_CBEGIN) ++end;
+  if ((size_t)(jit_buf + JIT_CODE_SIZE - jit_pos) < (end - k + 1) * JIT_MAX_INSTR_BYTES) return;
+
+  jit_fixup *fixups   = malloc((end - k) * sizeof(jit_fixup));
+  size_t     nfixups  = 0;
+  bool      *compiled = malloc((end - k) * sizeof(bool));
+  if (fixups == 0 || compiled == 0) failure("*** FAILURE: unable to allocate memory.\n");
+
+  jit_protect(PROT_READ | PROT_WRITE);
+  for (size_t j = k + 1; j < end; ++j) {
+    jit_native[j]       = jit_pos;
+    compiled[j - k - 1] = jit_emit_instr(j, fixups, &nfixups);
+    if (!compiled[j - k - 1]) jit_emit_exit(j);
+  }
+  /* Верификатор не пропускает выполнение за конец функции, но на всякий случай */
+  jit_emit_exit(end);
+
+  /* Все переходы верифицированного кода остаются внутри функции,
+     остальное отдаём интерпретатору */
+  for (size_t f = 0; f < nfixups; ++f) {
+    size_t         target = prog.p[fixups[f].k].a.target - prog.p;
+    unsigned char *at     = fixups[f].at;
+    if (k < target && target < end && compiled[target - k - 1]) {
+      jit_patch_rel(at, jit_native[target]);
+    } else {
+      jit_patch_rel(at, jit_pos);
+      jit_emit_exit(target);
+    }
+  }
+  jit_protect(PROT_READ | PROT_EXEC);
+
+  /* Точки входа: начало функции и инструкции после тех, что исполняет интерпретатор,
+     в том числе адреса возврата из вызовов */
+  for (size_t j = k + 1; j < end; ++j) {
+    if (compiled[j - k - 1] && (j == k + 1 || !compiled[j - k - 2])) {
+      prog.p[j].op = OPCODE_JIT_ENTER;
+    }
+  }
+
+  free(compiled);
+  free(fixups);
+}
+
+/* Выделяет память под код, пишет общие пролог и эпилог и ставит счётчики на все функции */
+static void jit_init () {
+  jit_ops    = malloc(prog.n * sizeof(int));
+  jit_calls  = calloc(prog.n, sizeof(int));
+  jit_native = calloc(prog.n, sizeof(unsigned char *));
+  if (jit_ops == 0 || jit_calls == 0 || jit_native == 0) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  jit_buf = mmap(0, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit_buf == MAP_FAILED) failure("JIT: %s\n", strerror(errno));
+  jit_pos = jit_buf;
+
+  /* int jit_run(void *target) */
+  jit_run = (jit_entry_fn)jit_pos;
+  jit_emit(4, 0x55, 0x53, 0x56, 0x57);         /* push ebp, ebx, esi, edi */
+  jit_emit(3, 0x83, 0xEC, JIT_OUTGOING_BYTES); /* sub esp, JIT_OUTGOING_BYTES */
+  jit_emit(2, 0x8B, 0x35);                     /* mov esi, [__gc_stack_top] */
+  jit_addr(&__gc_stack_top);
+  jit_emit(2, 0x8B, 0x1D); /* mov ebx, [locals] */
+  jit_addr(&locals);
+  jit_emit(2, 0x8B, 0x3D); /* mov edi, [args] */
+  jit_addr(&args);
+  jit_emit(4, 0xFF, 0x64, 0x24, JIT_OUTGOING_BYTES + 20); /* jmp [esp + target] */
+
+  /* Выход, номер инструкции в eax */
+  jit_exit = jit_pos;
+  jit_emit(2, 0x89, 0x35); /* mov [__gc_stack_top], esi */
+  jit_addr(&__gc_stack_top);
+  jit_emit(3, 0x83, 0xC4, JIT_OUTGOING_BYTES); /* add esp, JIT_OUTGOING_BYTES */
+  jit_emit(5, 0x5F, 0x5E, 0x5B, 0x5D, 0xC3);   /* pop edi, esi, ebx, ebp; ret */
+  jit_protect(PROT_READ | PROT_EXEC);
+
+  for (size_t k = 0; k < prog.n; ++k) {
+    jit_ops[k] = prog.p[k].op;
+    if (jit_ops[k] == OPCODE_BEGIN || jit_ops[k] == OPCODE_CBEGIN) prog.p[k].op = OPCODE_JIT_BEGIN;
+  }
+  /* Главная функция вызывается один раз, её компилируем сразу */
+  jit_calls[0] = jit_threshold - 1;
+}
+#endif
+
 static void interpret (bytefile *bf) {
   __gc_init();
   __gc_stack_bottom = (size_t)(stack_data + STACK_SIZE);
@@ -346,6 +781,7 @@ static void interpret (bytefile *bf) {
 
   /* Будем хранить глобальные переменные также на стеке,
      чтобы их тоже видел сборщик мусора */
+  check_headroom(bf->global_area_size + 1);
   for (int i = 0; i < bf->global_area_size; ++i) s_push(0);
   globals.p = s_top();
   globals.n = bf->global_area_size;
@@ -353,390 +789,571 @@ static void interpret (bytefile *bf) {
   /* Фиктивный адрес возврата для главной функции */
   s_push(0);
 
-#define INT instr_int()
-#define BYTE instr_byte()
-#define STRING instr_string(bf)
-#define FAIL failure("ERROR: invalid opcode %d-%d\n", h, l)
 #define UNUSED failure("Unused instruction, line %d\n", __LINE__)
 
-  code.p  = bf->code_ptr;
-  code.n  = (unsigned char *)bf->buffer + bf->size - bf->code_ptr;
-  p_instr = code.p;
+  p_instr = prog.p;
+
+  /* Вершина стека хранится в локальной переменной tos, а указатель стека --- в sp,
+     чтобы компилятор держал их в регистрах, а не обращался каждый раз
+     к __gc_stack_top и stack_data. Домашняя ячейка вершины sp[1]
+     при этом может быть устаревшей, остальные элементы лежат в памяти.
+     Перед вызовами, которые работают со стеком или могут запустить
+     сборку мусора, стек записывается в память (SPILL), а после них
+     загружается обратно (RELOAD): сборщик мог передвинуть объекты.
+     Функции рантайма, которые не выделяют память, получают значения
+     прямо из регистров.
+
+     Стек никогда не пуст: под операндами всегда лежит заголовок фрейма,
+     а под ним --- фиктивный адрес возврата главной функции. */
+  size_t *sp;
+  size_t  tos;
+
+#define SPILL                                                                                      \
+  do {                                                                                             \
+    sp[1]          = tos;                                                                          \
+    __gc_stack_top = (size_t)sp;                                                                   \
+  } while (0)
+#define RELOAD                                                                                     \
+  do {                                                                                             \
+    sp     = (size_t *)__gc_stack_top;                                                             \
+    tos    = sp[1];                                                                                \
+    closed = p_stack_frame->closure ? (size_t *)p_stack_frame->closure + 1 : 0;                    \
+  } while (0)
+#define PUSH(x)                                                                                    \
+  do {                                                                                             \
+    size_t push_x = (x);                                                                           \
+    DEBUG_ASSERT_MSG(sp >= stack_data, "Stack overflow at %p\n", instr_desc());                    \
+    sp[1] = tos;                                                                                   \
+    --sp;                                                                                          \
+    tos = push_x;                                                                                  \
+  } while (0)
+/* Снимает n элементов вместе с вершиной */
+#define POP_N(n)                                                                                   \
+  do {                                                                                             \
+    sp += (n);                                                                                     \
+    DEBUG_ASSERT_MSG(sp < globals.p, "Stack underflow at %p\n", instr_desc());                     \
+    tos = sp[1];                                                                                   \
+  } while (0)
+/* Элемент под вершиной */
+#define SECOND sp[2]
+
+  /* Фреймов ещё нет, поэтому не RELOAD */
+  sp  = (size_t *)__gc_stack_top;
+  tos = sp[1];
+
+#ifdef THREADED_DISPATCH
+#  define LABEL_BINOP(name, op) [OPCODE_BINOP_##name] = &&op_BINOP_##name,
+#  define LABEL_LD(name, addr) [OPCODE_LD_##name] = &&op_LD_##name,
+#  define LABEL_LDA(name, addr) [OPCODE_LDA_##name] = &&op_LDA_##name,
+#  define LABEL_ST(name, addr) [OPCODE_ST_##name] = &&op_ST_##name,
+#  define LABEL_LD_A_LD_A_BINOP(name, op)                                                          \
+    [OPCODE_LD_A_LD_A_BINOP_##name] = &&op_LD_A_LD_A_BINOP_##name,
+#  define LABEL_CONST_BINOP(name, op) [OPCODE_CONST_BINOP_##name] = &&op_CONST_BINOP_##name,
+#  define LABEL_BINOP_CJMP_Z(name, op) [OPCODE_BINOP_CJMP_Z_##name] = &&op_BINOP_CJMP_Z_##name,
+#  define LABEL(name, code) [OPCODE_##name] = &&op_##name,
+  static void *const dispatch_table[256] = {
+      [0 ... 255]                           = &&op_invalid,
+      [OP(HI_STOP, 0) ... OP(HI_STOP, 0xF)] = &&op_STOP,
+      MACRO_ALL_OPCODES(LABEL)};
+#  undef LABEL
+#  undef LABEL_BINOP_CJMP_Z
+#  undef LABEL_CONST_BINOP
+#  undef LABEL_LD_A_LD_A_BINOP
+#  undef LABEL_ST
+#  undef LABEL_LDA
+#  undef LABEL_LD
+#  undef LABEL_BINOP
+
+#  define INSTR(name) op_##name:
+#  ifdef OPCODE_STATS
+#    define DISPATCH                                                                               \
+      count_op(p_instr->op);                                                                       \
+      goto *dispatch_table[p_instr->op]
+#  else
+#    define DISPATCH goto *dispatch_table[p_instr->op]
+#  endif
+
+  DISPATCH;
+  {
+#else
+#  define INSTR(name) case OPCODE_##name:
+#  define DISPATCH continue
 
   for (;;) {
-    instr_desc           = (void *)(p_instr - code.p);
-    unsigned char opcode = BYTE, h = (opcode & 0xF0) >> 4, l = opcode & 0x0F;
-
-    switch (h) {
-      case HI_STOP: goto stop;
-
-      case HI_BINOP: {
-        int y = UNBOX(s_pop());
-        int x = UNBOX(s_pop());
-        int z = 0;
-        switch (l) {
-#define ENTRY(name, op)                                                                            \
-  case BINOP_##name: z = x op y; break;
-          MACRO_BINOPS(ENTRY)
-#undef ENTRY
-          default: FAIL;
-        }
-        s_push(BOX(z));
-      } break;
-
-      case HI_1:
-        switch (l) {
-          case LO_1_CONST: {
-            int x = INT;
-            s_push(BOX(x));
-          } break;
-
-          case LO_1_STRING: {
-            char *cstr = STRING;
-            void *str  = Bstring(cstr);
-            s_push((size_t)str);
-          } break;
-
-          case LO_1_SEXP: {
-            char  *tag    = STRING;
-            int    nelems = INT;
-            size_t x      = Wsexp(tag, nelems);
-            s_push(x);
-          } break;
-
-          case LO_1_STI: UNUSED; break;
-
-          case LO_1_STA: {
-            size_t v = s_pop();
-            size_t i = s_pop();
-            /* Будем различать адреса переменных и индексы по старшему
-               не знаковому биту индекса. Младший отнимается BOX'ом,
-               поэтому получается, что настоящий адрес --- 29-битный */
-            if (i & 0x40000000) {
-              int pos         = i & ~0x40000000;
-              pos             = UNBOX(pos);
-              stack_data[pos] = v;
-              s_push(v);
-            } else {
-              size_t x = s_pop();
-              size_t y = (size_t)Bsta((void *)v, i, (void *)x);
-              s_push(y);
-            }
-          } break;
-
-          case LO_1_JMP: {
-            int addr = INT;
-            checked_jmp(addr);
-          } break;
-
-          case LO_1_END: {
-            size_t  retval       = s_pop();
-            size_t *p_prev_frame = (size_t *)*p_stack_frame;
-            if (p_prev_frame == 0) {
-              /* Выходим из главной функции */
-              goto stop;
-            }
-            int frame_size = locals.n + args.n + 4;
-            int ret_addr   = p_stack_frame[3 + locals.n];
-            if (ret_addr & 0x80000000) {
-              /* Возврат из замыкания */
-              ++frame_size;
-              ret_addr &= 0x7FFFFFFF;
-            }
-            checked_jmp(ret_addr);
-
-            /* Убираем текущий фрейм */
-            for (int i = 0; i < frame_size; ++i) s_pop();
-            p_stack_frame = p_prev_frame;
-
-            locals.n = UNBOX(p_stack_frame[1]);
-            args.n   = UNBOX(p_stack_frame[2]);
-
-            locals.p = p_stack_frame + 3;
-            /* Можно переставлять местами аргументы при вызове,
-               т.к. на вершине стека перед вызовом --- последний,
-               но проще поменять знак при разыменовании */
-            args.p = locals.p + locals.n + args.n;
-
-            ret_addr = p_stack_frame[3 + locals.n];
-            if (ret_addr & 0x80000000) {
-              /* Вернулись в замыкание */
-              size_t closure = args.p[1];
-              data  *obj     = TO_DATA(closure);
-              closed.n       = LEN(obj->data_header) - 1;
-              closed.p       = (size_t *)obj->contents + 1;
-            } else {
-              /* Вернулись в обычную функцию */
-              closed.n = 0;
-              closed.p = 0;
-            }
-            s_push(retval);
-          } break;
-
-          case LO_1_RET: UNUSED; break;
-
-          case LO_1_DROP: s_pop(); break;
-
-          case LO_1_DUP: {
-            /* pop покажет stack underflow */
-            size_t x = s_pop();
-            s_push(x);
-            s_push(x);
-          } break;
-
-          case LO_1_SWAP: UNUSED; break;
-
-          case LO_1_ELEM: {
-            size_t i = s_pop();
-            size_t p = s_pop();
-            size_t y = (size_t)Belem((void *)p, i);
-            s_push(y);
-          } break;
-
-          default: FAIL;
-        }
-        break;
+#  ifdef OPCODE_STATS
+    count_op(p_instr->op);
+#  endif
+    switch (p_instr->op) {
+#endif
+
+/* Переход к следующей инструкции и переход по адресу.
+   Должны стоять на верхнем уровне обработчика, не внутри циклов */
+#define NEXT                                                                                       \
+  ++p_instr;                                                                                       \
+  DISPATCH
+#define JUMP(target)                                                                               \
+  p_instr = (target);                                                                              \
+  DISPATCH
+/* Переход за суперинструкцию из n исходных инструкций */
+#define SKIP(n)                                                                                    \
+  p_instr += (n);                                                                                  \
+  DISPATCH
+
+#define BINOP(name, op)                                                                            \
+  INSTR(BINOP_##name) {                                                                            \
+    int y = UNBOX(tos);                                                                            \
+    int x = UNBOX(SECOND);                                                                         \
+    ++sp;                                                                                          \
+    tos = BOX(x op y);                                                                             \
+  }                                                                                                \
+  NEXT;
+    MACRO_BINOPS(BINOP)
+#undef BINOP
+
+    INSTR(CONST) {
+      int x = p_instr->a.n;
+      PUSH(BOX(x));
+    }
+    NEXT;
+
+    INSTR(STRING) {
+      char *cstr = p_instr->a.s;
+      SPILL;
+      void *str = Bstring(cstr);
+      RELOAD;
+      PUSH((size_t)str);
+    }
+    NEXT;
+
+    INSTR(SEXP) {
+      int    hash   = p_instr->c.n;
+      int    nelems = p_instr->b.n;
+      SPILL;
+      size_t x = Wsexp(hash, nelems);
+      RELOAD;
+      PUSH(x);
+    }
+    NEXT;
+
+    INSTR(STI) UNUSED;
+    NEXT;
+
+    INSTR(STA) {
+      size_t v = tos;
+      size_t i = SECOND;
+      /* Будем различать адреса переменных и индексы по старшему
+         не знаковому биту индекса. Младший отнимается BOX'ом,
+         поэтому получается, что настоящий адрес --- 29-битный */
+      if (i & 0x40000000) {
+        int pos         = i & ~0x40000000;
+        pos             = UNBOX(pos);
+        stack_data[pos] = v;
+        ++sp;
+        tos = v;
+      } else {
+        size_t x = sp[3];
+        size_t y = (size_t)Bsta((void *)v, i, (void *)x);
+        sp += 2;
+        tos = y;
+      }
+    }
+    NEXT;
+
+    INSTR(JMP) { JUMP(p_instr->a.target); }
+
+    INSTR(END) {
+      frame *f = p_stack_frame;
+      if (f->prev == 0) {
+        /* Выходим из главной функции */
+        goto stop;
+      }
+      p_instr = prog.p + (f->ret & 0x7FFFFFFF);
+
+      /* Убираем фрейм целиком, возвращаемое значение (оно уже в tos)
+         займёт место замыкания или первого аргумента */
+      sp = f->args + (f->closure != 0) - 1;
+      set_frame(f->prev);
+    }
+    DISPATCH;
+
+    INSTR(RET) UNUSED;
+    NEXT;
+
+    INSTR(DROP) POP_N(1);
+    NEXT;
+
+    INSTR(DUP) PUSH(tos);
+    NEXT;
+
+    INSTR(SWAP) UNUSED;
+    NEXT;
+
+    INSTR(ELEM) {
+      size_t i = tos;
+      size_t p = SECOND;
+      size_t y = (size_t)Belem((void *)p, i);
+      ++sp;
+      tos = y;
+    }
+    NEXT;
+
+#define LD(name, addr)                                                                             \
+  INSTR(LD_##name) {                                                                               \
+    int i = p_instr->a.n;                                                                          \
+    PUSH(*(addr));                                                                                 \
+  }                                                                                                \
+  NEXT;
+    MACRO_MEMS(LD)
+#undef LD
+
+#define LDA(name, addr)                                                                            \
+  INSTR(LDA_##name) {                                                                              \
+    int i = p_instr->a.n;                                                                          \
+    size_t pos = (addr)-stack_data;                                                                \
+    PUSH(BOX(pos) | 0x40000000);                                                                   \
+  }                                                                                                \
+  NEXT;
+    MACRO_MEMS(LDA)
+#undef LDA
+
+/* Захваченные переменные лежат в объекте замыкания в куче, запись в них видит барьер */
+#define ST(name, addr)                                                                             \
+  INSTR(ST_##name) {                                                                               \
+    int     i    = p_instr->a.n;                                                                   \
+    size_t *slot = addr;                                                                           \
+    *slot        = tos;                                                                            \
+    if (MEM_##name == MEM_C) gc_write_barrier(slot, (void *)tos);                                  \
+  }                                                                                                \
+  NEXT;
+    MACRO_MEMS(ST)
+#undef ST
+
+    INSTR(CJMP_Z) {
+      size_t x = tos;
+      POP_N(1);
+      if (UNBOX(x) == 0) { JUMP(p_instr->a.target); }
+    }
+    NEXT;
+
+    INSTR(CJMP_NZ) {
+      size_t x = tos;
+      POP_N(1);
+      if (UNBOX(x) != 0) { JUMP(p_instr->a.target); }
+    }
+    NEXT;
+
+    INSTR(BEGIN) {
+      SPILL;
+      check_headroom(p_instr->c.n);
+      do_begin(p_instr->a.n, p_instr->b.n);
+      RELOAD;
+    }
+    NEXT;
+
+#ifdef JIT_SUPPORTED
+    /* BEGIN или CBEGIN функции, которую ещё не скомпилировали */
+    INSTR(JIT_BEGIN) {
+      size_t k = p_instr - prog.p;
+      if (++jit_calls[k] >= jit_threshold) jit_compile(k);
+      SPILL;
+      check_headroom(p_instr->c.n);
+      do_begin(p_instr->a.n, p_instr->b.n);
+      RELOAD;
+    }
+    NEXT;
+
+    INSTR(JIT_ENTER) {
+      SPILL;
+      int resume = jit_run(jit_native[p_instr - prog.p]);
+      RELOAD;
+      JUMP(prog.p + resume);
+    }
+#endif
+
+    INSTR(CBEGIN) {
+      SPILL;
+      check_headroom(p_instr->c.n);
+      /* Т.к. замыкание может быть ссылкой на функцию,
+         то его наличие на стеке придётся проверять и
+         в обычном BEGIN */
+      do_begin(p_instr->a.n, p_instr->b.n);
+      RELOAD;
+    }
+    NEXT;
+
+    INSTR(CLOSURE) {
+      int      entry    = p_instr->a.n;
+      int      n        = p_instr->b.n;
+      capture *captures = p_instr->c.captures;
+      for (int j = 0; j < n; j++) {
+        int mem_type = captures[j].mem;
+        int i        = captures[j].i;
 
-      case HI_LD: {
-        int    i = INT;
         size_t x = 0;
-        check_nvars(l, i);
-
-        switch (l) {
-          case MEM_G: x = globals.p[i]; break;
-          case MEM_L: x = locals.p[i]; break;
-          case MEM_A: x = args.p[-i]; break;
-          case MEM_C: x = closed.p[i]; break;
-          default: FAIL;
-        }
-        s_push(x);
-      } break;
-
-      case HI_LDA: {
-        size_t *addr = 0;
-        int     i    = INT;
-        check_nvars(l, i);
-
-        switch (l) {
-          case MEM_G: addr = globals.p + i; break;
-          case MEM_L: addr = locals.p + i; break;
-          case MEM_A: addr = args.p - i; break;
-          case MEM_C: addr = closed.p + i; break;
-          default: FAIL;
-        }
-        size_t pos = addr - stack_data;
-        s_push(BOX(pos) | 0x40000000);
-      } break;
-
-      case HI_ST: {
-        int i = INT;
-        check_nvars(l, i);
-
-        size_t x = *(size_t *)s_top();
-        switch (l) {
-          case MEM_G: globals.p[i] = x; break;
-          case MEM_L: locals.p[i] = x; break;
-          case MEM_A: args.p[-i] = x; break;
-          case MEM_C: closed.p[i] = x; break;
-          default: FAIL;
+        switch (mem_type) {
+#define CAPTURE(name, addr)                                                                        \
+  case MEM_##name: x = *(addr); break;
+          MACRO_MEMS(CAPTURE)
+#undef CAPTURE
         }
-      } break;
-
-      case HI_2:
-        switch (l) {
-          case LO_2_CJMP_Z: {
-            int    addr = INT;
-            size_t x    = s_pop();
-            if (UNBOX(x) == 0) checked_jmp(addr);
-          } break;
-
-          case LO_2_CJMP_NZ: {
-            int    addr = INT;
-            size_t x    = s_pop();
-            if (UNBOX(x) != 0) checked_jmp(addr);
-          } break;
-
-          case LO_2_BEGIN:
-            args.n   = INT;
-            locals.n = INT;
-            ASSERT_MSG(args.n >= 0, "Negative function argument count at %p\n", instr_desc);
-            ASSERT_MSG(locals.n >= 0, "Negative function local variable count at %p\n", instr_desc);
-            do_begin();
-            break;
-
-          case LO_2_CBEGIN:
-            args.n   = INT;
-            locals.n = INT;
-            ASSERT_MSG(args.n >= 0, "Negative function argument count at %p\n", instr_desc);
-            ASSERT_MSG(locals.n >= 0, "Negative function local variable count at %p\n", instr_desc);
-            /* Т.к. замыкание может быть ссылкой на функцию,
-               то его наличие на стеке придётся проверять и
-               в обычном BEGIN */
-            do_begin();
-            break;
-
-          case LO_2_CLOSURE: {
-            int entry = INT;
-            int n     = INT;
-            for (int j = 0; j < n; j++) {
-              char mem_type = BYTE;
-              int  i        = INT;
-              check_nvars(mem_type, i);
-
-              size_t x = 0;
-              switch (mem_type) {
-                case MEM_G: x = globals.p[i]; break;
-                case MEM_L: x = locals.p[i]; break;
-                case MEM_A: x = args.p[-i]; break;
-                case MEM_C: x = closed.p[i]; break;
-                default: FAIL;
-              }
-              s_push(x);
-            }
-            size_t closure = Wclosure(entry, n);
-            s_push(closure);
-          } break;
-
-          case LO_2_CALLC: {
-            int nargs = INT;
-            /* Снять замыкание со стека, если у него нет аргументов, здесь нельзя.
-               Придётся обрабатывать наличие замыкания в BEGIN */
-            size_t closure  = s_top()[nargs];
-            data  *obj      = TO_DATA(closure);
-            int   *arr      = (int *)obj->contents;
-            int    addr     = arr[0];
-            size_t ret_addr = (p_instr - code.p) | 0x80000000;
-            s_push(ret_addr);
-            checked_jmp(addr);
-          } break;
-
-          case LO_2_CALL: {
-            int    addr     = INT;
-            int    nargs    = INT;
-            size_t ret_addr = p_instr - code.p;
-            s_push(ret_addr);
-            checked_jmp(addr);
-          } break;
-
-          case LO_2_TAG: {
-            char  *tag    = STRING;
-            int    nelems = INT;
-            size_t x      = s_pop();
-            int    hash   = LtagHash(tag);
-            int    y      = Btag((void *)x, hash, BOX(nelems));
-            s_push(y);
-          } break;
-
-          case LO_2_ARRAY: {
-            int    n = INT;
-            size_t x = s_pop();
-            size_t y = Barray_patt((void *)x, BOX(n));
-            s_push(y);
-          } break;
-
-          case LO_2_FAIL: {
-            int line = INT;
-            int col  = INT;
-            failure("%d:%d\n", line, col);
-          } break;
-
-          case LO_2_LINE: {
-            /* Игнорируем эту инструкцию,
-               также как и в исходной реализации Ламы */
-            (void)INT;
-          } break;
-
-          default: FAIL;
-        }
-        break;
+        PUSH(x);
+      }
+      SPILL;
+      size_t closure = Wclosure(entry, n);
+      RELOAD;
+      PUSH(closure);
+    }
+    NEXT;
+
+    INSTR(CALLC) {
+      int nargs = p_instr->a.n;
+      /* Снять замыкание со стека, если у него нет аргументов, здесь нельзя.
+         Придётся обрабатывать наличие замыкания в BEGIN */
+      size_t closure = nargs == 0 ? tos : sp[1 + nargs];
+      data  *obj     = TO_DATA(closure);
+      int   *arr     = (int *)obj->contents;
+      int    addr    = arr[0];
+      /* Адрес возврата --- номер следующей инструкции */
+      size_t ret_addr = (p_instr + 1 - prog.p) | 0x80000000;
+      PUSH(ret_addr);
+      JUMP(instr_at(addr));
+    }
 
-      case HI_PATT:
-        switch (l) {
-          case PATT_EQ_STRING: {
-            size_t y = s_pop();
-            size_t x = s_pop();
-            size_t z = Bstring_patt((void *)x, (void *)y);
-            s_push(z);
-          } break;
-          case PATT_TAG_STRING: {
-            size_t x = s_pop();
-            size_t y = Bstring_tag_patt((void *)x);
-            s_push(y);
-          } break;
-          case PATT_TAG_ARRAY: {
-            size_t x = s_pop();
-            size_t y = Barray_tag_patt((void *)x);
-            s_push(y);
-          } break;
-          case PATT_TAG_SEXP: {
-            size_t x = s_pop();
-            size_t y = Bsexp_tag_patt((void *)x);
-            s_push(y);
-          } break;
-          case PATT_TAG_REF: {
-            size_t x = s_pop();
-            size_t y = Bboxed_patt((void *)x);
-            s_push(y);
-          } break;
-          case PATT_TAG_VAL: {
-            size_t x = s_pop();
-            size_t y = Bunboxed_patt((void *)x);
-            s_push(y);
-          } break;
-          case PATT_TAG_FUN: {
-            size_t x = s_pop();
-            size_t y = Bclosure_tag_patt((void *)x);
-            s_push(y);
-          } break;
-          default: FAIL; break;
-        }
-        break;
+    INSTR(CALL) {
+      size_t ret_addr = p_instr + 1 - prog.p;
+      PUSH(ret_addr);
+      JUMP(p_instr->a.target);
+    }
 
-      case HI_BUILTIN: {
-        switch (l) {
-          case BUILTIN_READ: {
-            int x = Lread();
-            s_push(x);
-          } break;
-
-          case BUILTIN_WRITE: {
-            size_t x = s_pop();
-            size_t y = Lwrite(x);
-            s_push(y);
-          } break;
-
-          case BUILTIN_LENGTH: {
-            size_t x = s_pop();
-            size_t y = Llength((void *)x);
-            s_push(y);
-          } break;
-
-          case BUILTIN_STRING: {
-            size_t x = s_pop();
-            size_t y = (size_t)Lstring((void *)x);
-            s_push(y);
-          } break;
-
-          case BUILTIN_ARRAY: {
-            int    n = INT;
-            size_t x = Warray(n);
-            s_push(x);
-          } break;
-
-          default: FAIL;
-        }
-      } break;
+    /* Стек не растёт, поэтому хвостовая рекурсия работает как цикл */
+    INSTR(TAIL_CALLC) {
+      int    nargs   = p_instr->a.n;
+      size_t closure = nargs == 0 ? tos : sp[1 + nargs];
+      int    addr    = ((int *)TO_DATA(closure)->contents)[0];
+      SPILL;
+      sp  = tail_call(sp, nargs + 1, 0x80000000);
+      tos = sp[1];
+      JUMP(instr_at(addr));
+    }
+
+    INSTR(TAIL_CALL) {
+      SPILL;
+      sp  = tail_call(sp, p_instr->b.n, 0);
+      tos = sp[1];
+      JUMP(p_instr->a.target);
+    }
 
-      default: FAIL;
+    INSTR(TAG) {
+      int    hash   = p_instr->c.n;
+      int    nelems = p_instr->b.n;
+      size_t x      = tos;
+      int    y      = Btag((void *)x, hash, BOX(nelems));
+      tos           = y;
     }
+    NEXT;
+
+    INSTR(ARRAY) {
+      int    n = p_instr->a.n;
+      size_t x = tos;
+      size_t y = Barray_patt((void *)x, BOX(n));
+      tos      = y;
+    }
+    NEXT;
+
+    INSTR(FAIL) {
+      int line = p_instr->a.n;
+      int col  = p_instr->b.n;
+      failure("%d:%d\n", line, col);
+    }
+    NEXT;
+
+    /* Игнорируем эту инструкцию,
+       также как и в исходной реализации Ламы */
+    INSTR(LINE) {}
+    NEXT;
+
+    INSTR(PATT_EQ_STRING) {
+      size_t y = tos;
+      size_t x = SECOND;
+      size_t z = Bstring_patt((void *)x, (void *)y);
+      ++sp;
+      tos = z;
+    }
+    NEXT;
+
+#define PATT(name, fn)                                                                             \
+  INSTR(name) {                                                                                    \
+    size_t x = tos;                                                                                \
+    size_t y = fn((void *)x);                                                                      \
+    tos      = y;                                                                                  \
+  }                                                                                                \
+  NEXT;
+    PATT(PATT_TAG_STRING, Bstring_tag_patt)
+    PATT(PATT_TAG_ARRAY, Barray_tag_patt)
+    PATT(PATT_TAG_SEXP, Bsexp_tag_patt)
+    PATT(PATT_TAG_REF, Bboxed_patt)
+    PATT(PATT_TAG_VAL, Bunboxed_patt)
+    PATT(PATT_TAG_FUN, Bclosure_tag_patt)
+#undef PATT
+
+    INSTR(BUILTIN_READ) {
+      int x = Lread();
+      PUSH(x);
+    }
+    NEXT;
+
+    INSTR(BUILTIN_WRITE) {
+      size_t x = tos;
+      size_t y = Lwrite(x);
+      tos      = y;
+    }
+    NEXT;
+
+    INSTR(BUILTIN_LENGTH) {
+      size_t x = tos;
+      size_t y = Llength((void *)x);
+      tos      = y;
+    }
+    NEXT;
+
+    INSTR(BUILTIN_STRING) {
+      /* Lstring выделяет память, аргумент должен быть виден сборщику */
+      SPILL;
+      size_t y = (size_t)Lstring((void *)tos);
+      RELOAD;
+      tos = y;
+    }
+    NEXT;
+
+    INSTR(BUILTIN_ARRAY) {
+      int n = p_instr->a.n;
+      SPILL;
+      size_t x = Warray(n);
+      RELOAD;
+      PUSH(x);
+    }
+    NEXT;
+
+    /* Суперинструкции */
+
+#define LD_A_LD_A_BINOP(name, op)                                                                  \
+  INSTR(LD_A_LD_A_BINOP_##name) {                                                                  \
+    int x = UNBOX(args[-p_instr[0].a.n]);                                                          \
+    int y = UNBOX(args[-p_instr[1].a.n]);                                                          \
+    PUSH(BOX(x op y));                                                                             \
+  }                                                                                                \
+  SKIP(3);
+    MACRO_BINOPS(LD_A_LD_A_BINOP)
+#undef LD_A_LD_A_BINOP
+
+#define CONST_BINOP(name, op)                                                                      \
+  INSTR(CONST_BINOP_##name) {                                                                      \
+    int y = p_instr->a.n;                                                                          \
+    int x = UNBOX(tos);                                                                            \
+    tos   = BOX(x op y);                                                                           \
+  }                                                                                                \
+  SKIP(2);
+    MACRO_BINOPS(CONST_BINOP)
+#undef CONST_BINOP
+
+    /* Условие проверяется так же, как в CJMPz: после упаковки результата */
+#define BINOP_CJMP_Z(name, op)                                                                     \
+  INSTR(BINOP_CJMP_Z_##name) {                                                                     \
+    int y = UNBOX(tos);                                                                            \
+    int x = UNBOX(SECOND);                                                                         \
+    POP_N(2);                                                                                      \
+    if (UNBOX(BOX(x op y)) == 0) { JUMP(p_instr[1].a.target); }                                    \
+  }                                                                                                \
+  SKIP(2);
+    MACRO_BINOPS(BINOP_CJMP_Z)
+#undef BINOP_CJMP_Z
+
+    INSTR(DUP_TAG_CJMP_Z) {
+      /* Значение остаётся на стеке, как после DUP и снятия результата TAG */
+      size_t x    = tos;
+      int    hash = p_instr[1].c.n;
+      int    y    = Btag((void *)x, hash, BOX(p_instr[1].b.n));
+      if (UNBOX(y) == 0) { JUMP(p_instr[2].a.target); }
+    }
+    SKIP(3);
+
+    INSTR(DROP_JMP) {
+      POP_N(1);
+      JUMP(p_instr[1].a.target);
+    }
+
+#ifdef THREADED_DISPATCH
+  op_STOP:
+    goto stop;
+
+  op_invalid: {
+    unsigned char opcode = p_instr->op;
+    failure("ERROR: invalid opcode %d-%d\n", (opcode & 0xF0) >> 4, opcode & 0x0F);
   }
+  }
+#else
+      default: {
+        unsigned char opcode = p_instr->op;
+        if ((opcode & 0xF0) >> 4 == HI_STOP) goto stop;
+        failure("ERROR: invalid opcode %d-%d\n", (opcode & 0xF0) >> 4, opcode & 0x0F);
+      }
+    }
+  }
+#endif
+
+#undef SECOND
+#undef POP_N
+#undef PUSH
+#undef RELOAD
+#undef SPILL
+#undef SKIP
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+#undef INSTR
 
 stop:
+#ifdef OPCODE_STATS
+  print_opcode_stats();
+#endif
   __shutdown();
 }
 
 int main (int argc, char *argv[]) {
-  bytefile *f = read_file(argv[1]);
+  bool use_fusion = true;
+  int  i          = 1;
+
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    /* Без суперинструкций, чтобы можно было измерить их выигрыш */
+    if (strcmp(argv[i], "--no-fuse") == 0) use_fusion = false;
+#ifdef JIT_SUPPORTED
+    else if (strcmp(argv[i], "--jit") == 0) jit_enabled = true;
+    else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+      jit_enabled   = true;
+      jit_threshold = atoi(argv[i] + 16);
+      if (jit_threshold < 1) failure("Incorrect JIT threshold %s\n", argv[i] + 16);
+    }
+#endif
+    /* Настройки размера кучи, то же, что переменные окружения LAMA_GC_HEAP_INIT,
+       LAMA_GC_HEAP_MAX (в байтах, можно с суффиксом K, M или G) и LAMA_GC_TIME (в процентах) */
+    else if (strncmp(argv[i], "--heap-init=", 12) == 0) setenv("LAMA_GC_HEAP_INIT", argv[i] + 12, 1);
+    else if (strncmp(argv[i], "--heap-max=", 11) == 0) setenv("LAMA_GC_HEAP_MAX", argv[i] + 11, 1);
+    else if (strncmp(argv[i], "--gc-time=", 10) == 0) setenv("LAMA_GC_TIME", argv[i] + 10, 1);
+    else failure("Unknown option %s\n", argv[i]);
+  }
+  if (i >= argc)
+    failure("Usage: %s [--no-fuse] [--jit] [--jit-threshold=N] [--heap-init=SIZE] [--heap-max=SIZE] "
+            "[--gc-time=PERCENT] <file.bc>\n",
+            argv[0]);
+
+  bytefile *f = read_file(argv[i]);
+  decode(f);
+  verify(f);
+  mark_tail_calls();
+  if (use_fusion) fuse();
+#ifdef JIT_SUPPORTED
+  if (jit_enabled) jit_init();
+#endif
   interpret(f);
   free(f);
   return 0;